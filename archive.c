@@ -0,0 +1,465 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mpssh.h"
+#include "host.h"
+#include "archive.h"
+
+static int              arc_fd = -1;
+static char            *arc_buf;
+static size_t           arc_len;        /* bytes in arc_buf */
+static uint64_t         arc_off;        /* file offset of arc_buf[0] */
+static struct arc_host *arc_hosts;
+static uint32_t         arc_nhosts;
+static uint32_t         arc_cap;
+
+/* the record still open for appending, if its header is buffered */
+static int              cur_id = -1;
+static int              cur_stream;
+static size_t           cur_hdr;
+
+static void
+put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+    put32(p, v);
+    put32(p + 4, v >> 32);
+}
+
+static uint16_t
+get16(const unsigned char *p)
+{
+    return(p[0] | p[1] << 8);
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+    return(get16(p) | (uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+    return(get32(p) | (uint64_t)get32(p + 4) << 32);
+}
+
+static void
+arc_write(const void *data, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(arc_fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perr("archive write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        data = (const char *)data + n;
+        len -= n;
+        arc_off += n;
+    }
+}
+
+static void
+arc_flush(void)
+{
+    arc_write(arc_buf, arc_len);
+    arc_len = 0;
+    cur_id = -1;
+}
+
+/*
+ * append to the archive through the buffer, data bigger
+ * than the buffer is written out directly
+ */
+static void
+arc_append(const void *data, size_t len)
+{
+    if (arc_len + len > ARCBUF)
+        arc_flush();
+    if (len >= ARCBUF) {
+        arc_write(data, len);
+        return;
+    }
+    memcpy(arc_buf + arc_len, data, len);
+    arc_len += len;
+}
+
+/*
+ * create the archive file
+ */
+void
+archive_open(char *fname)
+{
+    arc_fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (arc_fd < 0) {
+        perr("can't create archive %s: %s\n", fname, strerror(errno));
+        exit(1);
+    }
+    arc_buf = malloc(ARCBUF);
+    if (arc_buf == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    arc_append(ARC_MAGIC, ARC_MAGICLEN);
+}
+
+/*
+ * add a host to the index, returns its id
+ */
+int
+archive_host(struct host *hst)
+{
+    struct arc_host *h;
+
+    if (arc_nhosts == arc_cap) {
+        arc_cap = arc_cap ? arc_cap * 2 : 1024;
+        arc_hosts = realloc(arc_hosts, arc_cap * sizeof(struct arc_host));
+        if (arc_hosts == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+    }
+    h = &arc_hosts[arc_nhosts];
+    memset(h, 0, sizeof(struct arc_host));
+    h->user = strdup(hst->user);
+    h->host = strdup(hst->host);
+    if (h->user == NULL || h->host == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    h->port = hst->port;
+    h->ret = ARC_NORET;
+    return(arc_nhosts++);
+}
+
+/*
+ * store one line of output. consecutive lines of the same
+ * host and stream are merged into one record as long as
+ * its header is still in the buffer.
+ */
+void
+archive_line(int id, int stream, const char *data, size_t len)
+{
+    struct arc_host *h;
+    unsigned char    hdr[ARC_RECHDR];
+
+    h = &arc_hosts[id];
+    h->bytes += len + 1;
+
+    if (id == cur_id && stream == cur_stream &&
+        arc_len + len + 1 <= ARCBUF) {
+        put32((unsigned char *)arc_buf + cur_hdr + 4,
+            get32((unsigned char *)arc_buf + cur_hdr + 4) + len + 1);
+        memcpy(arc_buf + arc_len, data, len);
+        arc_len += len;
+        arc_buf[arc_len++] = '\n';
+        return;
+    }
+
+    if (arc_len + ARC_RECHDR > ARCBUF)
+        arc_flush();
+
+    put32(hdr, id);
+    put32(hdr + 4, len + 1);
+    put64(hdr + 8, h->last);
+    hdr[16] = stream;
+    h->last = arc_off + arc_len;
+    h->nrec++;
+    cur_hdr = arc_len;
+    arc_append(hdr, ARC_RECHDR);
+    cur_id = id;
+    cur_stream = stream;
+    arc_append(data, len);
+    arc_append("\n", 1);
+}
+
+/*
+ * record the exit code of a host
+ */
+void
+archive_exit(int id, int ret)
+{
+    arc_hosts[id].ret = ret;
+}
+
+/*
+ * write the index and the trailer and close the archive
+ */
+void
+archive_close(void)
+{
+    uint32_t         i;
+    uint64_t         idx_off;
+    size_t           ulen;
+    size_t           hlen;
+    struct arc_host *h;
+    unsigned char    hdr[ARC_IDXHDR];
+
+    if (arc_fd < 0)
+        return;
+
+    idx_off = arc_off + arc_len;
+    for (i = 0; i < arc_nhosts; i++) {
+        h = &arc_hosts[i];
+        ulen = strlen(h->user);
+        hlen = strlen(h->host);
+        put32(hdr, h->ret);
+        put64(hdr + 4, h->last);
+        put64(hdr + 12, h->bytes);
+        put32(hdr + 20, h->nrec);
+        put16(hdr + 24, h->port);
+        put16(hdr + 26, ulen);
+        put16(hdr + 28, hlen);
+        arc_append(hdr, ARC_IDXHDR);
+        arc_append(h->user, ulen);
+        arc_append(h->host, hlen);
+        free(h->user);
+        free(h->host);
+    }
+    put64(hdr, idx_off);
+    put32(hdr + 8, arc_nhosts);
+    memcpy(hdr + 12, ARC_IMAGIC, ARC_MAGICLEN);
+    arc_append(hdr, ARC_TRAILER);
+    arc_flush();
+
+    close(arc_fd);
+    arc_fd = -1;
+    free(arc_buf);
+    free(arc_hosts);
+}
+
+static int
+arc_pread(int fd, void *buf, size_t len, uint64_t off)
+{
+    ssize_t n;
+
+    while (len) {
+        n = pread(fd, buf, len, off);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return(-1);
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        off += n;
+    }
+    return(0);
+}
+
+static int
+arc_writeout(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return(-1);
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return(0);
+}
+
+/*
+ * copy one host's output out of the archive, following
+ * its record chain. stdout records go to stdout and stderr
+ * records to stderr. without a host name, list the index.
+ * returns the exit code of the host, RET_NOEXIT if it never
+ * exited, or 1 on error.
+ */
+int
+archive_extract(char *fname, char *name)
+{
+    int            fd;
+    int            ret = 1;
+    int            found;
+    char           ubuf[MAXNAME * 3 + 1];
+    char           copybuf[65536];
+    unsigned char  tr[ARC_TRAILER];
+    unsigned char  hdr[ARC_RECHDR];
+    unsigned char *idx = NULL;
+    unsigned char *p;
+    unsigned char *end;
+    uint64_t      *offs = NULL;
+    uint64_t       idx_off;
+    uint64_t       o;
+    uint32_t       nhosts;
+    uint32_t       nrec;
+    uint32_t       i;
+    uint32_t       len;
+    size_t         n;
+    struct stat    st;
+    struct arc_host h;
+    struct arc_host hit;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        perr("can't open archive %s: %s\n", fname, strerror(errno));
+        return(1);
+    }
+    if (fstat(fd, &st) || st.st_size < ARC_MAGICLEN + ARC_TRAILER ||
+        arc_pread(fd, tr, ARC_TRAILER, st.st_size - ARC_TRAILER) ||
+        memcmp(tr + 12, ARC_IMAGIC, ARC_MAGICLEN)) {
+        perr("%s: not an mpssh archive or incomplete\n", fname);
+        goto out;
+    }
+    idx_off = get64(tr);
+    nhosts = get32(tr + 8);
+    if (idx_off > (uint64_t)st.st_size - ARC_TRAILER) {
+        perr("%s: corrupt archive index\n", fname);
+        goto out;
+    }
+
+    n = st.st_size - ARC_TRAILER - idx_off;
+    idx = malloc(n + 1);
+    if (idx == NULL || arc_pread(fd, idx, n, idx_off)) {
+        perr("%s: can't read archive index\n", fname);
+        goto out;
+    }
+    end = idx + n;
+
+    memset(&h, 0, sizeof(h));
+    found = 0;
+    for (p = idx, i = 0; i < nhosts; i++) {
+        if (p + ARC_IDXHDR > end)
+            break;
+        h.ret = get32(p);
+        h.last = get64(p + 4);
+        h.bytes = get64(p + 12);
+        h.nrec = get32(p + 20);
+        h.port = get16(p + 24);
+        len = get16(p + 26);
+        n = get16(p + 28);
+        if (p + ARC_IDXHDR + len + n > end || len + n + 2 > sizeof(ubuf))
+            break;
+        /* user@host, the host part starts after the @ */
+        memcpy(ubuf, p + ARC_IDXHDR, len);
+        ubuf[len] = '@';
+        memcpy(ubuf + len + 1, p + ARC_IDXHDR + len, n);
+        ubuf[len + 1 + n] = '\0';
+        p += ARC_IDXHDR + len + n;
+
+        if (name == NULL) {
+            if (h.port != NON_DEFINED_PORT)
+                printf("%s:%d", ubuf, h.port);
+            else
+                printf("%s", ubuf);
+            if (h.ret == ARC_NORET)
+                printf(" no exit, %llu bytes\n",
+                    (unsigned long long)h.bytes);
+            else
+                printf(" exit %d, %llu bytes\n", h.ret,
+                    (unsigned long long)h.bytes);
+            continue;
+        }
+        /* a retried host has an entry per attempt, the last one wins */
+        if (!strcmp(name, ubuf) || !strcmp(name, ubuf + len + 1)) {
+            hit = h;
+            found = 1;
+        }
+    }
+    if (name == NULL) {
+        ret = 0;
+        goto out;
+    }
+    if (!found) {
+        perr("%s: no host %s in the archive\n", fname, name);
+        goto out;
+    }
+    h = hit;
+
+    /* walk the chain backwards, then copy the records in order */
+    nrec = h.nrec;
+    offs = calloc(nrec ? nrec : 1, sizeof(uint64_t));
+    if (offs == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        goto out;
+    }
+    for (o = h.last, i = nrec; i > 0; i--) {
+        if (o < ARC_MAGICLEN || o >= idx_off ||
+            arc_pread(fd, hdr, ARC_RECHDR, o)) {
+            perr("%s: corrupt record chain\n", fname);
+            goto out;
+        }
+        offs[i - 1] = o;
+        o = get64(hdr + 8);
+    }
+
+    fflush(stdout);
+    for (i = 0; i < nrec; i++) {
+        if (arc_pread(fd, hdr, ARC_RECHDR, offs[i])) {
+            perr("%s: short record\n", fname);
+            goto out;
+        }
+        len = get32(hdr + 4);
+        o = offs[i] + ARC_RECHDR;
+        while (len) {
+            n = len < sizeof(copybuf) ? len : sizeof(copybuf);
+            if (arc_pread(fd, copybuf, n, o)) {
+                perr("%s: short record\n", fname);
+                goto out;
+            }
+            if (arc_writeout(hdr[16] == ERR ? 2 : 1, copybuf, n)) {
+                perr("can't write the output of %s: %s\n", name,
+                    strerror(errno));
+                goto out;
+            }
+            o += n;
+            len -= n;
+        }
+    }
+
+    ret = h.ret == ARC_NORET ? RET_NOEXIT : h.ret;
+
+out:
+    free(offs);
+    free(idx);
+    close(fd);
+    return(ret);
+}
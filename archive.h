@@ -0,0 +1,64 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * single file output archive (--archive). the file starts
+ * with ARC_MAGIC, followed by the output records of all the
+ * hosts as they arrive, then the per host index and a fixed
+ * size trailer pointing at it. all integers are little endian.
+ *
+ * record:  u32 host id, u32 data len, u64 offset of the
+ *          previous record of the same host (0 if none),
+ *          u8 stream (OUT or ERR), data
+ * index:   per host: i32 exit code, u64 offset of the last
+ *          record, u64 data bytes, u32 record count, u16 port,
+ *          u16 user len, u16 host len, user, host
+ * trailer: u64 index offset, u32 host count, ARC_IMAGIC
+ *
+ * the records of one host form a chain through the previous
+ * offsets, so a reader can pull a single host by seeking.
+ */
+#define ARC_MAGIC    "MPSSHAR1"
+#define ARC_IMAGIC   "MPSSHIDX"
+#define ARC_MAGICLEN 8
+#define ARC_RECHDR   17
+#define ARC_IDXHDR   30
+#define ARC_TRAILER  20
+#define ARC_NORET    -1             /* the host never exited */
+#define ARCBUF       (1024 * 1024)
+
+/* in memory index entry */
+struct
+arc_host {
+    char     *user;
+    char     *host;
+    uint16_t  port;
+    int32_t   ret;
+    uint64_t  last;
+    uint64_t  bytes;
+    uint32_t  nrec;
+};
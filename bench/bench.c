@@ -0,0 +1,412 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * end to end benchmark of mpssh, run against the fake ssh.
+ * every scenario generates a host list, runs mpssh on it with
+ * the fake ssh and reads all of its output, then reports the
+ * hosts and lines per second, the cpu time of the mpssh
+ * process alone (not of its children) and its peak rss.
+ *
+ *  bench [-q] [-m mpssh] [-s fakessh] [scenario ...]
+ *
+ * -q runs the scenarios with a tenth of the hosts. the script
+ * scenarios run a script with -r, streamed over the session
+ * and copied with scp first, one wave of hosts each, so their
+ * wall time is the latency of a host. spawnrss spawns as many
+ * hosts as spawn while mpssh holds a 1M line host list parsed
+ * in its heap rather than mapped from the cache, its rss shows
+ * how large the parent is and the difference in hosts/s with
+ * spawn is what that size costs the spawns. pool runs once
+ * without the connection pool, then twice with it, opening the
+ * master connections and then reusing them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAXARGS     32
+#define RDBUF       65536
+#define RSS_EVERY   0.01            /* rss sampling interval, sec */
+
+struct
+scenario {
+    char   *name;
+    char   *desc;
+    int     hosts;
+    int     procs;
+    int     select;                 /* hosts under the selected label */
+    int     runs;
+    char   *env;                    /* FAKESSH_* settings */
+    char   *flags;                  /* more mpssh flags, %s is the tmpdir */
+    char   *first;                  /* the flags of the first run, if set */
+};
+
+static struct scenario scenarios[] = {
+    { "spawn", "hosts with 1 line each",
+        10000, 200, 0, 1, "FAKESSH_LINES=1", "", NULL },
+    { "spawnrss", "hosts with 1 line each, 1M host list in memory",
+        1000000, 200, 10000, 1, "FAKESSH_LINES=1", "--no-cache -l sel", NULL },
+    { "latency", "hosts with 150-250 ms connect latency",
+        2000, 500, 0, 1,
+        "FAKESSH_LATENCY_MS=150 FAKESSH_JITTER_MS=100 FAKESSH_LINES=10", "", NULL },
+    { "mixed", "hosts, 1k lines, 30% stderr, 5% failures",
+        2000, 200, 0, 1,
+        "FAKESSH_LINES=1000 FAKESSH_ERR_PCT=30 FAKESSH_FAIL_PCT=5 "
+        "FAKESSH_EXIT=3", "-e", NULL },
+    { "volume", "hosts with 50 MB each",
+        500, 100, 0, 1, "FAKESSH_BYTES=52428800 FAKESSH_LINELEN=99", "", NULL },
+    { "collect", "hosts with 50 MB each, 4 collector threads",
+        500, 100, 0, 1, "FAKESSH_BYTES=52428800 FAKESSH_LINELEN=99",
+        "--collectors=4", NULL },
+    { "byhost", "hosts with 10 MB each, by host in 64 MB",
+        200, 100, 0, 1, "FAKESSH_BYTES=10485760 FAKESSH_LINELEN=99",
+        "--by-host --by-host-mem=64", NULL },
+    { "json", "hosts with 50 MB each, as JSON lines",
+        500, 100, 0, 1, "FAKESSH_BYTES=52428800 FAKESSH_LINELEN=99",
+        "--json", NULL },
+    { "longline", "hosts with 4 MB in 64 KB lines",
+        200, 100, 0, 1, "FAKESSH_BYTES=4194304 FAKESSH_LINELEN=65535", "", NULL },
+    { "group", "hosts with 100 lines, grouped",
+        5000, 200, 0, 1, "FAKESSH_LINES=100", "-g", NULL },
+    { "archive", "hosts with 1 MB each, archived",
+        1000, 100, 0, 1, "FAKESSH_BYTES=1048576", "-b -a %s/archive", NULL },
+    { "select", "host list, 100 hosts labeled, cold and cached",
+        200000, 100, 100, 2, "FAKESSH_LINES=1", "-l sel", NULL },
+    { "pool", "hosts with 200 ms latency, no pool, new and pooled",
+        2000, 2000, 0, 3, "FAKESSH_LATENCY_MS=200 FAKESSH_LINES=10",
+        "-P --pool-dir=%s/pool", "" },
+    { "parse", "line host list parsed, 100 hosts labeled",
+        1000000, 100, 100, 1, "FAKESSH_LINES=1", "--no-cache -l sel", NULL },
+    { "script", "hosts running a script streamed over ssh",
+        500, 500, 0, 1, "FAKESSH_LATENCY_MS=200 FAKESSH_LINES=10",
+        "-r %s/script", NULL },
+    { "scriptscp", "hosts running a script copied with scp",
+        500, 500, 0, 1, "FAKESSH_LATENCY_MS=200 FAKESSH_LINES=10",
+        "-r %s/script --script-scp", NULL },
+    { NULL, NULL, 0, 0, 0, 0, NULL, NULL, NULL }
+};
+
+static char *mpssh = "./mpssh";
+static char *fakessh = "./bench/fakessh";
+static char  tmpdir[] = "/tmp/mpssh-bench.XXXXXX";
+
+/* the script of the script scenarios, a few KB of shell */
+static void
+mkscript(void)
+{
+    char  path[64];
+    FILE *fh;
+    int   i;
+
+    snprintf(path, sizeof(path), "%s/script", tmpdir);
+    fh = fopen(path, "w");
+    if (fh == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(fh, "#!/bin/sh\n");
+    for (i = 0; i < 100; i++)
+        fprintf(fh, "echo \"step %d of the deployment script\"\n", i);
+    fclose(fh);
+    chmod(path, 0755);
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+mkhosts(char *path, struct scenario *sc, int hosts)
+{
+    FILE *fh;
+    int   i;
+
+    fh = fopen(path, "w");
+    if (fh == NULL) {
+        perror(path);
+        exit(1);
+    }
+    if (sc->select)
+        fprintf(fh, "%%rest\n");
+    for (i = 0; i < hosts; i++) {
+        if (sc->select && i == hosts - sc->select)
+            fprintf(fh, "%%sel\n");
+        fprintf(fh, "host%d.bench\n", i);
+    }
+    fclose(fh);
+}
+
+/* VmHWM of a live process, in KB */
+static long
+peakrss(pid_t pid)
+{
+    char  path[64];
+    char  line[256];
+    long  kb = 0;
+    FILE *fh;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((fh = fopen(path, "r")) == NULL)
+        return(0);
+    while (fgets(line, sizeof(line), fh))
+        if (sscanf(line, "VmHWM: %ld", &kb) == 1)
+            break;
+    fclose(fh);
+    return(kb);
+}
+
+/*
+ * user and system time of the process itself, read while it is
+ * a zombie. wait4() would add the time of its reaped children,
+ * the fake ssh processes.
+ */
+static void
+selfcpu(pid_t pid, double *usr, double *sys)
+{
+    char   path[64];
+    char   buf[1024];
+    char  *p;
+    int    fd, n, i;
+    long   hz = sysconf(_SC_CLK_TCK);
+    unsigned long ut = 0, st = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    *usr = *sys = 0;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return;
+    buf[n] = '\0';
+    /* the fields after the command name, utime is the 14th */
+    if ((p = strrchr(buf, ')')) == NULL)
+        return;
+    for (i = 3; i <= 14 && p; i++)
+        p = strchr(p + 1, ' ');
+    if (p == NULL || sscanf(p, " %lu %lu", &ut, &st) != 2)
+        return;
+    *usr = (double)ut / hz;
+    *sys = (double)st / hz;
+}
+
+static void
+run(struct scenario *sc, int hosts, int nrun)
+{
+    char    hostfile[64];
+    char    flags[256];
+    char    procs[16];
+    char    envs[256];
+    char   *argv[MAXARGS];
+    char   *p;
+    char    ssharg[300];
+    char    buf[RDBUF];
+    int     argc = 0;
+    int     pfd[2];
+    int     status;
+    long    rss = 0;
+    long    r;
+    unsigned long lines = 0;
+    unsigned long long bytes = 0;
+    double  t0, wall, last = 0, usr, sys;
+    pid_t   pid;
+    ssize_t n;
+    siginfo_t si;
+    struct pollfd pl;
+
+    snprintf(hostfile, sizeof(hostfile), "%s/hosts", tmpdir);
+    if (nrun == 0)
+        mkhosts(hostfile, sc, hosts);
+
+    snprintf(ssharg, sizeof(ssharg), "--ssh=%s", fakessh);
+    snprintf(procs, sizeof(procs), "%d", sc->procs);
+    snprintf(flags, sizeof(flags),
+        nrun == 0 && sc->first ? sc->first : sc->flags, tmpdir);
+
+    argv[argc++] = mpssh;
+    argv[argc++] = ssharg;
+    argv[argc++] = "-d0";
+    argv[argc++] = "-p";
+    argv[argc++] = procs;
+    argv[argc++] = "-f";
+    argv[argc++] = hostfile;
+    for (p = strtok(flags, " "); p && argc < MAXARGS - 2; p = strtok(NULL, " "))
+        argv[argc++] = p;
+    /* a script takes the place of the command */
+    if (strncmp(sc->flags, "-r ", 3))
+        argv[argc++] = "true";
+    argv[argc] = NULL;
+
+    if (pipe(pfd) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    t0 = now();
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(pfd[1], 1);
+        dup2(pfd[1], 2);
+        close(pfd[0]);
+        close(pfd[1]);
+        /* the host index cache goes in the tmpdir too */
+        setenv("HOME", tmpdir, 1);
+        snprintf(envs, sizeof(envs), "%s", sc->env);
+        for (p = strtok(envs, " "); p; p = strtok(NULL, " "))
+            putenv(strdup(p));
+        execv(mpssh, argv);
+        perror(mpssh);
+        _exit(127);
+    }
+    close(pfd[1]);
+
+    pl.fd = pfd[0];
+    pl.events = POLLIN;
+    for (;;) {
+        if (poll(&pl, 1, 20) > 0) {
+            n = read(pfd[0], buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            bytes += n;
+            for (p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+                lines++;
+        }
+        if (now() - last > RSS_EVERY) {
+            last = now();
+            if ((r = peakrss(pid)) > rss)
+                rss = r;
+        }
+    }
+    close(pfd[0]);
+
+    /* wait for it to exit, but read its cpu time before reaping */
+    waitid(P_PID, pid, &si, WEXITED | WNOWAIT);
+    wall = now() - t0;
+    selfcpu(pid, &usr, &sys);
+    waitpid(pid, &status, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "%s: mpssh failed\n", sc->name);
+        return;
+    }
+
+    printf("%-9s %7d %8.2f %9.0f %10lu %10.0f %8.1f %7.2f %7.2f %8ld\n",
+        sc->name, sc->select ? sc->select : hosts, wall,
+        (sc->select ? sc->select : hosts) / wall, lines, lines / wall,
+        bytes / wall / 1048576, usr, sys, rss);
+    fflush(stdout);
+}
+
+static void
+usage(void)
+{
+    struct scenario *sc;
+
+    fprintf(stderr, "usage: bench [-q] [-m mpssh] [-s fakessh] "
+        "[scenario ...]\n\nscenarios:\n");
+    for (sc = scenarios; sc->name; sc++)
+        fprintf(stderr, "  %-9s %d %s\n", sc->name, sc->hosts, sc->desc);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct scenario *sc;
+    int    opt;
+    int    quick = 0;
+    int    hosts;
+    int    i, r;
+    char   cmd[64];
+
+    while ((opt = getopt(argc, argv, "qm:s:h")) != -1) {
+        switch (opt) {
+            case 'q':
+                quick = 1;
+                break;
+            case 'm':
+                mpssh = optarg;
+                break;
+            case 's':
+                fakessh = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (mkdtemp(tmpdir) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    mkscript();
+
+    printf("%-9s %7s %8s %9s %10s %10s %8s %7s %7s %8s\n",
+        "scenario", "hosts", "wall(s)", "hosts/s", "lines", "lines/s",
+        "MB/s", "usr(s)", "sys(s)", "rss(KB)");
+
+    for (sc = scenarios; sc->name; sc++) {
+        if (argc) {
+            for (i = 0; i < argc && strcmp(argv[i], sc->name); i++)
+                ;
+            if (i == argc)
+                continue;
+        }
+        hosts = quick ? sc->hosts / 10 : sc->hosts;
+        if (hosts < sc->select)
+            hosts = sc->select;
+        for (r = 0; r < sc->runs; r++)
+            run(sc, hosts, r);
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", tmpdir);
+    return(system(cmd) != 0);
+}
@@ -0,0 +1,232 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * fake ssh for the benchmarks. it takes the ssh command line
+ * mpssh builds, connects nowhere and simulates a session as
+ * told by the environment:
+ *
+ *  FAKESSH_LATENCY_MS  connect latency (0)
+ *  FAKESSH_JITTER_MS   random extra latency, up to (0)
+ *  FAKESSH_LINES       lines of output (1)
+ *  FAKESSH_BYTES       bytes of output, overrides FAKESSH_LINES
+ *  FAKESSH_LINELEN     line length, without the newline (64)
+ *  FAKESSH_ERR_PCT     percent of the lines sent to stderr (0)
+ *  FAKESSH_EXIT        exit code of the remote command (0)
+ *  FAKESSH_FAIL_PCT    percent of the hosts that fail to connect (0)
+ *
+ * the choices are seeded by the host name, so a host does the
+ * same thing on every run. a -oLocalCommand, the scp of
+ * mpssh --script-scp, costs a second connect latency, and
+ * whatever comes on stdin, such as a streamed script, is read
+ * before the output is written.
+ *
+ * with -oControlPath and -oControlMaster=auto the first
+ * session of a host pays the latency and leaves a file at the
+ * control path, where %C is the host name, and the sessions
+ * after it find the file and connect at once. -Ocheck and
+ * -Oexit test and remove the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#define WRBUF   65536
+
+static uint32_t seed;
+
+static long
+env(const char *name, long def)
+{
+    char *v = getenv(name);
+
+    return(v ? strtol(v, NULL, 10) : def);
+}
+
+/* xorshift, good enough to pick lines and hosts */
+static uint32_t
+rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return(seed);
+}
+
+static void
+writeall(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            exit(255);
+        buf += n;
+        len -= n;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    char    *host = NULL;
+    char    *line;
+    char    *ctl = NULL;
+    char    *ctlop = NULL;
+    char    *pct;
+    char     ctlpath[4096];
+    char    *buf[2];
+    size_t   blen[2] = { 0, 0 };
+    long     latency, jitter, lines, bytes, linelen, errpct, failpct;
+    long     i;
+    int      fd;
+    int      localcmd = 0;
+    int      master = 0;
+    struct timespec ts;
+
+    /* skip the options, the first argument left is the host */
+    for (i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "-oLocalCommand=", 15))
+            localcmd = 1;
+        if (!strncmp(argv[i], "-oControlPath=", 14))
+            ctl = argv[i] + 14;
+        if (!strcmp(argv[i], "-oControlMaster=auto"))
+            master = 1;
+        if (!strncmp(argv[i], "-O", 2) && argv[i][2])
+            ctlop = argv[i] + 2;
+        if (argv[i][0] != '-') {
+            host = argv[i];
+            break;
+        }
+        if (argv[i][2] == '\0' && strchr("bcDEeFIiJLlmOoPpQRSWw", argv[i][1]))
+            i++;
+    }
+    if (host == NULL) {
+        fprintf(stderr, "usage: fakessh [options] host [command]\n");
+        return(255);
+    }
+
+    seed = 2166136261U;
+    for (line = host; *line; line++)
+        seed = (seed ^ (unsigned char)*line) * 16777619U;
+    if (seed == 0)
+        seed = 1;
+
+    latency = env("FAKESSH_LATENCY_MS", 0);
+    jitter = env("FAKESSH_JITTER_MS", 0);
+    lines = env("FAKESSH_LINES", 1);
+    bytes = env("FAKESSH_BYTES", 0);
+    linelen = env("FAKESSH_LINELEN", 64);
+    errpct = env("FAKESSH_ERR_PCT", 0);
+    failpct = env("FAKESSH_FAIL_PCT", 0);
+
+    if (jitter > 0)
+        latency += rnd() % (jitter + 1);
+
+    if (ctl) {
+        pct = strstr(ctl, "%C");
+        if (pct)
+            snprintf(ctlpath, sizeof(ctlpath), "%.*s%s%s",
+                (int)(pct - ctl), ctl, host, pct + 2);
+        else
+            snprintf(ctlpath, sizeof(ctlpath), "%s", ctl);
+        if (ctlop) {
+            if (access(ctlpath, F_OK))
+                return(255);
+            if (!strcmp(ctlop, "exit"))
+                unlink(ctlpath);
+            return(0);
+        }
+        if (master && access(ctlpath, F_OK) == 0) {
+            /* multiplexed over the master, no connect */
+            latency = 0;
+        } else if (master) {
+            fd = open(ctlpath, O_WRONLY | O_CREAT, 0600);
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+    /* the scp runs over a connection of its own */
+    for (i = 0; i <= localcmd && latency > 0; i++) {
+        ts.tv_sec = latency / 1000;
+        ts.tv_nsec = (latency % 1000) * 1000000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+
+    if (failpct > 0 && (long)(rnd() % 100) < failpct) {
+        fprintf(stderr, "ssh: connect to host %s port 22: "
+            "Connection refused\n", host);
+        return(255);
+    }
+
+    if (linelen < 0)
+        linelen = 0;
+    if (bytes > 0)
+        lines = bytes / (linelen + 1);
+
+    /* the same text on all hosts, so that -g has groups */
+    line = malloc(linelen + 1);
+    buf[0] = malloc(WRBUF);
+    buf[1] = malloc(WRBUF);
+    if (line == NULL || buf[0] == NULL || buf[1] == NULL)
+        return(255);
+
+    /* no stdin at all unless mpssh fans something out */
+    while (read(0, buf[0], WRBUF) > 0)
+        ;
+    for (i = 0; i < linelen; i++)
+        line[i] = 'a' + i % 26;
+    line[linelen] = '\n';
+
+    for (i = 0; i < lines; i++) {
+        fd = (errpct > 0 && (long)(rnd() % 100) < errpct);
+        if (blen[fd] + linelen + 1 > WRBUF) {
+            writeall(fd + 1, buf[fd], blen[fd]);
+            blen[fd] = 0;
+        }
+        if (linelen + 1 > WRBUF) {
+            writeall(fd + 1, line, linelen + 1);
+            continue;
+        }
+        memcpy(buf[fd] + blen[fd], line, linelen + 1);
+        blen[fd] += linelen + 1;
+    }
+    writeall(1, buf[0], blen[0]);
+    writeall(2, buf[1], blen[1]);
+
+    return((int)env("FAKESSH_EXIT", 0));
+}
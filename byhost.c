@@ -0,0 +1,267 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "mpssh.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+#include "out.h"
+#include "byhost.h"
+
+void   outbuf_flush(struct outbuf *);
+void   outbuf_writev(int, struct iovec *, int);
+void   byhost_free(struct procslot *);
+
+size_t by_host_mem = (size_t)BYHOST_MEM << 20;
+
+static size_t hb_mem = 0;           /* buffer bytes of all the slots */
+
+/*
+ * an unlinked file in $TMPDIR, gone when it is closed
+ */
+static int
+spill_open(void)
+{
+    char   *dir;
+    char    path[PATH_MAX];
+    int     fd;
+
+    if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+        dir = "/tmp";
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+        return(fd);
+    /* no O_TMPFILE on this filesystem */
+    snprintf(path, sizeof(path), "%s/mpssh.XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0) {
+        perr("unable to create spill file in %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    unlink(path);
+    return(fd);
+}
+
+/*
+ * move the buffer of a slot to its spill file
+ */
+static void
+spill(struct hostbuf *hb)
+{
+    char   *p = hb->buf;
+    size_t  left = hb->len;
+    ssize_t n;
+
+    if (hb->fd < 0)
+        hb->fd = spill_open();
+    while (left) {
+        n = pwrite(hb->fd, p, left, hb->flen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perr("unable to write spill file: %s\n", strerror(errno));
+            exit(1);
+        }
+        p += n;
+        left -= n;
+        hb->flen += n;
+    }
+    hb_mem -= hb->cap;
+    free(hb->buf);
+    hb->buf = NULL;
+    hb->len = hb->cap = 0;
+}
+
+/*
+ * over the budget, spill the largest buffers until it fits
+ */
+static void
+byhost_trim(void)
+{
+    struct procslot *p;
+    struct hostbuf  *big;
+
+    while (hb_mem > by_host_mem && ps) {
+        big = NULL;
+        p = ps;
+        do {
+            if (p->hb && p->hb->cap && (!big || p->hb->cap > big->cap))
+                big = p->hb;
+            p = p->next;
+        } while (p != ps);
+        if (big == NULL)
+            return;
+        spill(big);
+    }
+}
+
+/*
+ * keep one line of the slot, prefix + line + newline
+ */
+void
+byhost_line(struct procslot *pslot, const char *pfx, size_t pfxlen,
+    const char *line, size_t len)
+{
+    struct hostbuf *hb;
+    size_t  need;
+    size_t  cap;
+
+    if ((hb = pslot->hb) == NULL) {
+        if ((hb = calloc(1, sizeof(struct hostbuf))) == NULL) {
+            perr("%s\n", strerror(errno));
+            exit(1);
+        }
+        hb->fd = -1;
+        pslot->hb = hb;
+    }
+
+    need = hb->len + pfxlen + len + 1;
+    if (need > hb->cap) {
+        cap = hb->cap ? hb->cap : BYHOST_MIN;
+        while (cap < need)
+            cap *= 2;
+        hb->buf = realloc(hb->buf, cap);
+        if (hb->buf == NULL) {
+            perr("%s\n", strerror(errno));
+            exit(1);
+        }
+        hb_mem += cap - hb->cap;
+        hb->cap = cap;
+    }
+    memcpy(hb->buf + hb->len, pfx, pfxlen);
+    hb->len += pfxlen;
+    memcpy(hb->buf + hb->len, line, len);
+    hb->len += len;
+    hb->buf[hb->len++] = '\n';
+
+    if (hb_mem > by_host_mem)
+        byhost_trim();
+}
+
+/*
+ * copy the spill file to stdout. copy_file_range() works
+ * when stdout is a file, sendfile() with anything else,
+ * read() and write() are left for the rest.
+ */
+static void
+byhost_copy(int fd, off_t len)
+{
+    static int  no_cfr = 0;
+    static int  no_sendfile = 0;
+    char        buf[65536];
+    off_t       off = 0;
+    ssize_t     n;
+    struct iovec  iov;
+    struct pollfd pfd;
+
+    while (off < len) {
+        if (!no_cfr) {
+            n = copy_file_range(fd, &off, 1, NULL, len - off, 0);
+            if (n > 0)
+                continue;
+            if (n < 0 && errno == EINTR)
+                continue;
+            no_cfr = 1;
+        }
+        if (!no_sendfile) {
+            n = sendfile(1, fd, &off, len - off);
+            if (n > 0)
+                continue;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN) {
+                pfd.fd = 1;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            /* stdout is gone, or sendfile() can't do it */
+            if (n < 0 && errno != EINVAL && errno != ENOSYS)
+                return;
+            no_sendfile = 1;
+        }
+        n = pread(fd, buf, sizeof(buf), off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        off += n;
+        iov.iov_base = buf;
+        iov.iov_len = n;
+        outbuf_writev(1, &iov, 1);
+    }
+}
+
+/*
+ * print the kept output of a reaped slot as one block,
+ * the spilled part first
+ */
+void
+byhost_print(struct procslot *pslot)
+{
+    struct hostbuf *hb = pslot->hb;
+    struct iovec    iov;
+
+    if (hb == NULL)
+        return;
+    outbuf_flush(&ob_out);
+    if (hb->fd >= 0)
+        byhost_copy(hb->fd, hb->flen);
+    if (hb->len) {
+        iov.iov_base = hb->buf;
+        iov.iov_len = hb->len;
+        outbuf_writev(1, &iov, 1);
+    }
+    byhost_free(pslot);
+}
+
+void
+byhost_free(struct procslot *pslot)
+{
+    struct hostbuf *hb = pslot->hb;
+
+    if (hb == NULL)
+        return;
+    if (hb->fd >= 0)
+        close(hb->fd);
+    hb_mem -= hb->cap;
+    free(hb->buf);
+    free(hb);
+    pslot->hb = NULL;
+}
@@ -0,0 +1,551 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "mpssh.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+#include "metrics.h"
+#include "out.h"
+#include "collect.h"
+
+int    pslot_readbuf(struct procslot *, int);
+void   pslot_flushbuf(struct procslot *, int);
+void   pslot_printbuf(struct procslot *, int, char *, size_t);
+void   outbuf_flush(struct outbuf *);
+void   outbuf_writev(int, struct iovec *, int);
+void   pace_connected(double);
+void   session_done(struct procslot *);
+
+static struct collector *colls = NULL;
+static int               ncolls = 0;
+static int               coll_wake = -1;    /* collectors -> writer */
+static struct evsrc      wake_src = { COLLECT, NULL };
+
+/* the collector of the calling thread */
+static __thread struct collector *thr_coll = NULL;
+
+/* batches waiting for the writer's next writev(), per fd */
+static struct iovec      wv[2][WRITEV_MAX];
+static struct cmsg       wb[2][WRITEV_MAX];
+static struct collector *wc[2][WRITEV_MAX];
+static int               wn[2];
+
+static void
+ring_init(struct cring *r, uint32_t n)
+{
+    uint32_t size = 1;
+
+    while (size < n)
+        size <<= 1;
+    r->msg = calloc(size, sizeof(struct cmsg));
+    if (r->msg == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+    r->mask = size - 1;
+    r->head = r->tail = 0;
+}
+
+/*
+ * the producer fills the entry before publishing the new
+ * tail, the consumer copies it out before giving the entry
+ * back with the new head. returns 0 if the ring is full.
+ */
+static int
+ring_put(struct cring *r, const struct cmsg *m)
+{
+    uint32_t t = r->tail;
+
+    if (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask)
+        return(0);
+    r->msg[t & r->mask] = *m;
+    __atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+    return(1);
+}
+
+static int
+ring_get(struct cring *r, struct cmsg *m)
+{
+    uint32_t h = r->head;
+
+    if (h == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return(0);
+    *m = r->msg[h & r->mask];
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+    return(1);
+}
+
+static void
+kick(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perr("unable to wake thread: %s\n", strerror(errno));
+}
+
+/*
+ * hand a message to the writer. if it is behind, wake it
+ * and wait for room, the pipes keep the rest of the output.
+ */
+static void
+coll_put(struct collector *c, const struct cmsg *m)
+{
+    while (!ring_put(&c->out, m)) {
+        kick(coll_wake);
+        sched_yield();
+    }
+}
+
+/*
+ * a batch written by the writer, a new one while there are
+ * less than BATCHES, or wait for the writer to free one
+ */
+static char *
+batch_alloc(struct collector *c)
+{
+    struct cmsg m;
+
+    for (;;) {
+        if (ring_get(&c->spare, &m))
+            return(m.buf);
+        if (c->nbatch < BATCHES)
+            break;
+        kick(coll_wake);
+        sched_yield();
+    }
+    if ((m.buf = malloc(OUTBUF)) == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+    c->nbatch++;
+    return(m.buf);
+}
+
+/*
+ * a full or idle batch of the calling collector goes to the
+ * writer, the collector continues with a new one
+ */
+void
+collect_batch(struct outbuf *ob)
+{
+    struct cmsg m;
+
+    if (!ob->len)
+        return;
+    memset(&m, 0, sizeof(m));
+    m.type = CM_OUT;
+    m.fd = ob->fd;
+    m.buf = ob->buf;
+    m.len = ob->len;
+    coll_put(ob->coll, &m);
+    ob->buf = batch_alloc(ob->coll);
+    ob->len = 0;
+}
+
+/*
+ * a line that does not fit in a batch gets one of its own
+ */
+void
+collect_line(struct outbuf *ob, const char *pfx, size_t pfxlen,
+    const char *line, size_t len)
+{
+    struct cmsg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = CM_LINE;
+    m.fd = ob->fd;
+    m.len = pfxlen + len + 1;
+    if ((m.buf = malloc(m.len)) == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+    memcpy(m.buf, pfx, pfxlen);
+    memcpy(m.buf + pfxlen, line, len);
+    m.buf[m.len - 1] = '\n';
+    coll_put(ob->coll, &m);
+}
+
+/*
+ * the first output of a slot, for the pacer
+ */
+void
+collect_connected(struct procslot *p)
+{
+    struct cmsg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = CM_CONNECTED;
+    m.ps = p;
+    m.secs = p->t_first - p->t_spawn;
+    coll_put(thr_coll, &m);
+}
+
+/*
+ * pass the bytes and lines counted since the last time
+ */
+static void
+collect_count(struct collector *c)
+{
+    struct cmsg m;
+
+    if (!c->met.bytes[0] && !c->met.bytes[1] &&
+        !c->met.lines[0] && !c->met.lines[1])
+        return;
+    memset(&m, 0, sizeof(m));
+    m.type = CM_COUNT;
+    m.n[0] = c->met.bytes[0];
+    m.n[1] = c->met.bytes[1];
+    m.n[2] = c->met.lines[0];
+    m.n[3] = c->met.lines[1];
+    coll_put(c, &m);
+    memset(&c->met, 0, sizeof(c->met));
+}
+
+static void
+collect_watch(struct collector *c, struct procslot *p)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &p->ev[0];
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, p->io.out[0], &ev) == 0) {
+        ev.data.ptr = &p->ev[1];
+        if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, p->io.err[0], &ev) == 0)
+            return;
+    }
+    perr("unable to register pipe: %s\n", strerror(errno));
+    exit(1);
+}
+
+/*
+ * the child is reaped, print what is left of its output and
+ * its status, then give the slot back to the main thread
+ */
+static void
+drain_slot(struct collector *c, struct procslot *p)
+{
+    struct cmsg m;
+
+    pslot_readbuf(p, OUT);
+    pslot_readbuf(p, ERR);
+    pslot_flushbuf(p, OUT);
+    pslot_flushbuf(p, ERR);
+    pslot_printbuf(p, OUT, NULL, 0);
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, p->io.out[0], NULL);
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, p->io.err[0], NULL);
+
+    memset(&m, 0, sizeof(m));
+    m.type = CM_DONE;
+    m.ps = p;
+    coll_put(c, &m);
+}
+
+/*
+ * collector thread. the output events are handled before
+ * the commands, so no event in a batch can point to a slot
+ * that was already given back.
+ */
+static void *
+collect_main(void *arg)
+{
+    struct collector   *c = arg;
+    struct epoll_event  events[MAXEVENTS];
+    struct evsrc       *src;
+    struct cmsg         m;
+    uint64_t            cnt;
+    uint32_t            tail;
+    int                 nev;
+    int                 i;
+
+    thr_coll = c;
+    thr_out = &c->ob[0];
+    thr_err = out_shared ? &c->ob[0] : &c->ob[1];
+    thr_metrics = &c->met;
+
+    for (;;) {
+        tail = c->out.tail;
+        nev = epoll_wait(c->epfd, events, MAXEVENTS, -1);
+        for (i = 0; i < nev; i++) {
+            src = events[i].data.ptr;
+            if (src->type == COLLECT) {
+                while (read(c->wake, &cnt, sizeof(cnt)) > 0)
+                    ;
+                continue;
+            }
+            pslot_readbuf(src->ps, src->type);
+        }
+
+        while (ring_get(&c->cmd, &m)) {
+            switch (m.type) {
+            case CM_ADD:
+                collect_watch(c, m.ps);
+                break;
+            case CM_FINISH:
+                drain_slot(c, m.ps);
+                break;
+            case CM_STOP:
+                outbuf_flush(&c->ob[0]);
+                outbuf_flush(&c->ob[1]);
+                collect_count(c);
+                m.type = CM_STOP;
+                coll_put(c, &m);
+                kick(coll_wake);
+                return(NULL);
+            }
+        }
+
+        /* the thread goes idle, pass on what it has */
+        outbuf_flush(&c->ob[0]);
+        outbuf_flush(&c->ob[1]);
+        collect_count(c);
+        if (c->out.tail != tail)
+            kick(coll_wake);
+    }
+}
+
+/*
+ * start n collector threads, called with SIGCHLD already
+ * blocked, which the threads inherit
+ */
+void
+collect_init(int n, int nslots)
+{
+    struct epoll_event ev;
+    struct collector  *c;
+    int    i;
+    int    err;
+
+    coll_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (coll_wake < 0) {
+        perr("unable to create eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_src;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, coll_wake, &ev)) {
+        perr("unable to register eventfd: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    colls = calloc(n, sizeof(struct collector));
+    if (colls == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+    ncolls = n;
+    for (i = 0; i < n; i++) {
+        c = &colls[i];
+        c->epfd = epoll_create1(EPOLL_CLOEXEC);
+        c->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (c->epfd < 0 || c->wake < 0) {
+            perr("unable to create collector: %s\n", strerror(errno));
+            exit(1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_src;
+        if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wake, &ev)) {
+            perr("unable to register eventfd: %s\n", strerror(errno));
+            exit(1);
+        }
+        /* an add and a finish per slot, and the stop */
+        ring_init(&c->cmd, 2 * nslots + 8);
+        ring_init(&c->out, CMSG_RING);
+        ring_init(&c->spare, BATCHES);
+        c->ob[0].fd = 1;
+        c->ob[0].buf = batch_alloc(c);
+        c->ob[0].coll = c;
+        c->ob[1].fd = 2;
+        c->ob[1].buf = batch_alloc(c);
+        c->ob[1].coll = c;
+        err = pthread_create(&c->thr, NULL, collect_main, c);
+        if (err) {
+            perr("unable to start collector: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+}
+
+static void
+command(struct collector *c, int type, struct procslot *p)
+{
+    struct cmsg m;
+
+    memset(&m, 0, sizeof(m));
+    m.type = type;
+    m.ps = p;
+    if (!ring_put(&c->cmd, &m)) {
+        /* sized for every slot, can't happen */
+        perr("collector command ring full\n");
+        exit(1);
+    }
+    kick(c->wake);
+}
+
+/*
+ * a new slot goes to the collector with the fewest slots
+ */
+void
+collect_add(struct procslot *p)
+{
+    struct collector *c;
+    int    i;
+
+    c = &colls[0];
+    for (i = 1; i < ncolls; i++)
+        if (colls[i].nslots < c->nslots)
+            c = &colls[i];
+    c->nslots++;
+    p->coll = c;
+    command(c, CM_ADD, p);
+}
+
+/*
+ * the child of the slot is reaped
+ */
+void
+collect_finish(struct procslot *p)
+{
+    command(p->coll, CM_FINISH, p);
+}
+
+/*
+ * write the gathered batches of fd i + 1, and give them
+ * back to their collectors
+ */
+static void
+writer_flush(int i)
+{
+    struct cmsg *m;
+    int    j;
+
+    if (!wn[i])
+        return;
+    outbuf_writev(i + 1, wv[i], wn[i]);
+    for (j = 0; j < wn[i]; j++) {
+        m = &wb[i][j];
+        /* the spare ring has room for all the batches */
+        if (m->type == CM_LINE || !ring_put(&wc[i][j]->spare, m))
+            free(m->buf);
+    }
+    wn[i] = 0;
+}
+
+/*
+ * the writer, run by the main thread when a collector has
+ * something for it. the batches are gathered per fd and
+ * written with one writev(). returns the number of
+ * collectors that stopped.
+ */
+int
+collect_drain(void)
+{
+    struct collector *c;
+    struct cmsg m;
+    uint64_t cnt;
+    int    stopped = 0;
+    int    i;
+    int    k;
+
+    while (read(coll_wake, &cnt, sizeof(cnt)) > 0)
+        ;
+
+    for (i = 0; i < ncolls; i++) {
+        c = &colls[i];
+        while (ring_get(&c->out, &m)) {
+            switch (m.type) {
+            case CM_OUT:
+            case CM_LINE:
+                k = m.fd - 1;
+                if (wn[k] == WRITEV_MAX)
+                    writer_flush(k);
+                wv[k][wn[k]].iov_base = m.buf;
+                wv[k][wn[k]].iov_len = m.len;
+                wc[k][wn[k]] = c;
+                wb[k][wn[k]++] = m;
+                break;
+            case CM_CONNECTED:
+                pace_connected(m.secs);
+                break;
+            case CM_COUNT:
+                metrics.bytes[0] += m.n[0];
+                metrics.bytes[1] += m.n[1];
+                metrics.lines[0] += m.n[2];
+                metrics.lines[1] += m.n[3];
+                break;
+            case CM_DONE:
+                c->nslots--;
+                session_done(m.ps);
+                break;
+            case CM_STOP:
+                stopped++;
+                break;
+            }
+        }
+    }
+    writer_flush(0);
+    writer_flush(1);
+    return(stopped);
+}
+
+/*
+ * stop the collectors once every slot is given back, the
+ * writer keeps draining until they are all gone
+ */
+void
+collect_stop(void)
+{
+    struct pollfd pfd;
+    int    stopped = 0;
+    int    i;
+
+    for (i = 0; i < ncolls; i++)
+        command(&colls[i], CM_STOP, NULL);
+    pfd.fd = coll_wake;
+    pfd.events = POLLIN;
+    while (stopped < ncolls) {
+        poll(&pfd, 1, 100);
+        stopped += collect_drain();
+    }
+    for (i = 0; i < ncolls; i++)
+        pthread_join(colls[i].thr, NULL);
+}
@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * output collector threads, --collectors. every collector
+ * owns a shard of the process slots and its own epoll set,
+ * reads their pipes, splits the lines and formats them into
+ * its own batches. the finished batches go to the writer,
+ * the main thread, through a single producer single consumer
+ * ring, so a line is still written whole, in one piece.
+ * the main thread keeps the children, the timers and the
+ * pacer and tells a collector about its slots on another
+ * ring going the other way. the written batches come back
+ * on a third one, a collector has at most BATCHES of them,
+ * so a slow terminal holds back the collectors, not memory.
+ */
+#define MAXCOLLECT   64             /* --collectors limit */
+#define CMSG_RING    4096           /* collector -> writer entries */
+#define WRITEV_MAX   64             /* batches per writev() */
+#define BATCHES      32             /* output batches per collector */
+
+/* ring messages */
+#define CM_ADD       1              /* new slot, watch its pipes */
+#define CM_FINISH    2              /* child reaped, drain the slot */
+#define CM_STOP      3              /* exit the thread */
+#define CM_OUT       4              /* a batch to write */
+#define CM_LINE      8              /* a line too long for a batch */
+#define CM_CONNECTED 5              /* first output of a slot */
+#define CM_DONE      6              /* slot drained, free it */
+#define CM_COUNT     7              /* bytes and lines read */
+
+struct
+cmsg {
+    int     type;
+    int     fd;                     /* CM_OUT */
+    char   *buf;
+    size_t  len;
+    struct  procslot *ps;
+    double  secs;                   /* CM_CONNECTED */
+    uint64_t n[4];                  /* CM_COUNT, bytes and lines */
+};
+
+/* single producer single consumer ring, size a power of two */
+struct
+cring {
+    struct  cmsg *msg;
+    uint32_t mask;
+    uint32_t head;                  /* moved by the consumer */
+    uint32_t tail;                  /* moved by the producer */
+};
+
+struct
+collector {
+    pthread_t thr;
+    int     epfd;
+    int     wake;                   /* eventfd, commands pending */
+    int     nslots;
+    struct  cring cmd;              /* writer -> collector */
+    struct  cring out;              /* collector -> writer */
+    struct  cring spare;            /* written batches, to reuse */
+    int     nbatch;                 /* batches allocated */
+    struct  outbuf ob[2];
+    struct  metrics met;
+};
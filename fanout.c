@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "mpssh.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+#include "fanout.h"
+
+static int      in_fd = -1;         /* memfd or the stdin file */
+static uint64_t in_start = 0;       /* where stdin was left */
+static uint64_t in_size = 0;
+static char    *in_map = NULL;      /* for write() if splice() fails */
+static int      in_splice = 1;
+
+/*
+ * copy the input pipe or tty into the memfd, with splice()
+ * if the kernel can do it from this kind of descriptor
+ */
+static void
+fanout_copy(int src, int fd)
+{
+    char    buf[65536];
+    ssize_t n;
+    ssize_t w;
+    ssize_t r;
+    int     use_splice = 1;
+
+    for (;;) {
+        if (use_splice) {
+            n = splice(src, NULL, fd, NULL, FANOUT_CHUNK, 0);
+            if (n < 0 && errno == EINVAL) {
+                use_splice = 0;
+                continue;
+            }
+        } else {
+            n = read(src, buf, sizeof(buf));
+            for (w = 0; n > 0 && w < n; ) {
+                r = write(fd, buf + w, n - w);
+                if (r < 0) {
+                    n = -1;
+                    break;
+                }
+                w += r;
+            }
+        }
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perr("unable to read the input: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+/*
+ * take in the whole input, our stdin or a streamed script,
+ * before any session starts. a file is sent from its
+ * current position on, like a read of it would.
+ */
+void
+fanout_init(int src)
+{
+    struct stat st;
+    off_t       pos;
+
+    if (fstat(src, &st)) {
+        perr("unable to stat the input: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (S_ISREG(st.st_mode)) {
+        /* already in the page cache, nothing to copy */
+        in_fd = src;
+        pos = lseek(src, 0, SEEK_CUR);
+        if (pos > 0)
+            in_start = pos < st.st_size ? pos : st.st_size;
+    } else {
+        in_fd = memfd_create("mpssh-stdin", MFD_CLOEXEC);
+        if (in_fd < 0) {
+            perr("unable to create memfd: %s\n", strerror(errno));
+            exit(1);
+        }
+        fanout_copy(src, in_fd);
+        if (fstat(in_fd, &st)) {
+            perr("unable to stat memfd: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    in_size = st.st_size - in_start;
+    if (in_size > 0) {
+        in_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, in_fd, 0);
+        if (in_map == MAP_FAILED) {
+            perr("unable to map the input: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+/*
+ * size of the input, for the banner
+ */
+uint64_t
+fanout_size(void)
+{
+    return(in_size);
+}
+
+/*
+ * give the slot a stdin pipe and watch its write end for
+ * EPOLLOUT. the first edge comes as soon as the pipe is
+ * registered, that is what starts the transfer. the slot
+ * gets all of the input, unless the caller narrows it down.
+ */
+void
+fanout_open(struct procslot *p)
+{
+    struct epoll_event ev;
+
+    if (pipe2(p->io.in, O_CLOEXEC)) {
+        perr("unable to create pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    fcntl(p->io.in[1], F_SETFL, O_NONBLOCK);
+    p->ev[2].type = IN;
+    p->ev[2].ps = p;
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.ptr = &p->ev[2];
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, p->io.in[1], &ev)) {
+        perr("unable to register pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    p->in_off = in_start;
+    p->in_end = in_start + in_size;
+}
+
+/*
+ * push as much of the input as the slot's pipe takes. when
+ * all of it is in, or the command closed its stdin, close
+ * the pipe so the command sees the end of its input.
+ */
+void
+fanout_write(struct procslot *p)
+{
+    ssize_t n;
+    loff_t  off;
+
+    if (p->io.in[1] < 0)
+        return;
+
+    while (p->in_off < p->in_end) {
+        if (in_splice) {
+            off = p->in_off;
+            n = splice(in_fd, &off, p->io.in[1], NULL,
+                p->in_end - p->in_off < FANOUT_CHUNK ?
+                p->in_end - p->in_off : FANOUT_CHUNK,
+                SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EINVAL) {
+                in_splice = 0;
+                continue;
+            }
+        } else {
+            n = write(p->io.in[1], in_map + p->in_off,
+                p->in_end - p->in_off < FANOUT_CHUNK ?
+                p->in_end - p->in_off : FANOUT_CHUNK);
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return;
+            /* EPIPE, the command does not want the rest */
+            break;
+        }
+        /* the file got shorter under us, that is the end of it */
+        if (n == 0)
+            break;
+        p->in_off += n;
+    }
+    close(p->io.in[1]);
+    p->io.in[1] = -1;
+}
@@ -0,0 +1,370 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mpssh.h"
+#include "host.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+static struct group  *grphash[GRPHASH];
+static struct group  *grp_first = NULL;
+static struct group  *grp_last = NULL;
+static struct group  *grp_top = NULL;     /* the one with most hosts */
+
+static uint64_t
+grp_hash(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+    return(h);
+}
+
+static void
+grp_append(struct grpstate *g, const void *data, size_t len)
+{
+    if (g->len + len > g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 1024;
+        while (g->cap < g->len + len)
+            g->cap *= 2;
+        g->buf = realloc(g->buf, g->cap);
+        if (g->buf == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+    }
+    memcpy(g->buf + g->len, data, len);
+    g->len += len;
+}
+
+/*
+ * start grouping a new slot, betting that its output will
+ * be the same as the most common one seen so far
+ */
+void
+group_start(struct procslot *pslot)
+{
+    struct grpstate *g = &pslot->grp;
+
+    memset(g, 0, sizeof(struct grpstate));
+    g->hash = FNV_OFFSET;
+    g->cand = grp_top;
+    if (g->cand == NULL)
+        g->own = 1;
+}
+
+/*
+ * feed one output line of the slot
+ */
+void
+group_line(struct procslot *pslot, int stream, const char *line, size_t len)
+{
+    struct grpstate *g = &pslot->grp;
+    struct group    *c = g->cand;
+    char             tag = stream;
+
+    g->hash = grp_hash(g->hash, &tag, 1);
+    g->hash = grp_hash(g->hash, line, len);
+    g->hash = grp_hash(g->hash, "\n", 1);
+
+    if (!g->own) {
+        if (g->off + len + 2 <= c->len &&
+            c->data[g->off] == tag &&
+            !memcmp(c->data + g->off + 1, line, len) &&
+            c->data[g->off + 1 + len] == '\n') {
+            g->off += len + 2;
+            return;
+        }
+        /* diverged, keep our own copy from now on */
+        g->own = 1;
+        grp_append(g, c->data, g->off);
+    }
+    grp_append(g, &tag, 1);
+    grp_append(g, line, len);
+    grp_append(g, "\n", 1);
+}
+
+/*
+ * the slot's child is gone, file its output under the
+ * group with the same output and exit code, or start a
+ * new group with it
+ */
+void
+group_done(struct procslot *pslot)
+{
+    struct grpstate *g = &pslot->grp;
+    struct group    *grp;
+    const char      *data;
+    uint64_t         hash;
+    size_t           len;
+    unsigned int     b;
+    int              ret;
+
+    /* timed out sessions are a group of their own */
+    ret = pslot->timedout ? -1 : pslot->ret;
+    hash = grp_hash(g->hash, &ret, sizeof(ret));
+    len = g->own ? g->len : g->off;
+    data = g->own ? g->buf : g->cand->data;
+    b = hash & (GRPHASH - 1);
+
+    /* the hash only narrows it down, the output has to match */
+    for (grp = grphash[b]; grp; grp = grp->hnext)
+        if (grp->hash == hash && grp->ret == ret && grp->len == len &&
+            (len == 0 || !memcmp(grp->data, data, len)))
+            break;
+
+    if (grp == NULL) {
+        grp = calloc(1, sizeof(struct group));
+        if (grp == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+        grp->hash = hash;
+        grp->ret = ret;
+        if (!g->own) {
+            /* a prefix of the candidate, or all of it */
+            grp_append(g, g->cand->data, g->off);
+        }
+        grp->data = g->buf;
+        grp->len = g->len;
+        g->buf = NULL;
+        grp->hnext = grphash[b];
+        grphash[b] = grp;
+        if (grp_last)
+            grp_last->next = grp;
+        else
+            grp_first = grp;
+        grp_last = grp;
+    }
+
+    free(g->buf);
+    g->buf = NULL;
+
+    if (grp->nhosts == grp->cap) {
+        grp->cap = grp->cap ? grp->cap * 2 : 16;
+        grp->hosts = realloc(grp->hosts, grp->cap * sizeof(char *));
+        if (grp->hosts == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+    }
+    grp->hosts[grp->nhosts] = strdup(pslot->hst->host);
+    if (grp->hosts[grp->nhosts] == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    grp->nhosts++;
+
+    if (grp_top == NULL || grp->nhosts > grp_top->nhosts)
+        grp_top = grp;
+}
+
+/*
+ * the slot's session failed and will be retried, forget
+ * its output, the next attempt starts grouping afresh
+ */
+void
+group_drop(struct procslot *pslot)
+{
+    free(pslot->grp.buf);
+    pslot->grp.buf = NULL;
+}
+
+/*
+ * split a host name around its last run of digits
+ */
+static void
+grp_digits(const char *s, size_t *start, size_t *end)
+{
+    size_t i;
+
+    i = strlen(s);
+    while (i > 0 && !isdigit((unsigned char)s[i - 1]))
+        i--;
+    /* no number at all, all of it is the prefix */
+    if (i == 0)
+        i = strlen(s);
+    *end = i;
+    while (i > 0 && isdigit((unsigned char)s[i - 1]))
+        i--;
+    *start = i;
+}
+
+static int
+digits(const char *s)
+{
+    int n = 0;
+
+    while (isdigit((unsigned char)s[n]))
+        n++;
+    return(n);
+}
+
+/*
+ * order host names by the text around the last number,
+ * then by the number, so that ranges end up adjacent
+ */
+static int
+grp_hostcmp(const void *a, const void *b)
+{
+    const char *x = *(const char **)a;
+    const char *y = *(const char **)b;
+    size_t      xs, xe, ys, ye;
+    int         r;
+
+    grp_digits(x, &xs, &xe);
+    grp_digits(y, &ys, &ye);
+
+    if ((r = strncmp(x, y, xs < ys ? xs : ys)))
+        return(r);
+    if (xs != ys)
+        return(xs < ys ? -1 : 1);
+    if ((r = strcmp(x + xe, y + ye)))
+        return(r);
+    if (xe - xs != ye - ys)
+        return(xe - xs < ye - ys ? -1 : 1);
+    return(strncmp(x + xs, y + ys, xe - xs));
+}
+
+/*
+ * two sorted names are in the same range if they differ
+ * only in the last number, and it either has the same
+ * width or is not zero padded in any of them
+ */
+static int
+grp_samerange(const char *x, const char *y)
+{
+    size_t xs, xe, ys, ye;
+
+    grp_digits(x, &xs, &xe);
+    grp_digits(y, &ys, &ye);
+    if (xs == xe || ys == ye || xs != ys)
+        return(0);
+    if (xe - xs != ye - ys && (x[xs] == '0' || y[ys] == '0'))
+        return(0);
+    return(!strncmp(x, y, xs) && !strcmp(x + xe, y + ye));
+}
+
+/*
+ * print the hosts of a group compacted into ranges,
+ * like web[01-03,07]
+ */
+static void
+grp_printhosts(FILE *fh, struct group *grp)
+{
+    int         i, j, k, b;
+    size_t      s, e;
+    long        a;
+    const char *h;
+
+    qsort(grp->hosts, grp->nhosts, sizeof(char *), grp_hostcmp);
+
+    for (i = 0; i < grp->nhosts; i = j) {
+        h = grp->hosts[i];
+        for (j = i + 1; j < grp->nhosts &&
+            grp_samerange(h, grp->hosts[j]); j++)
+            ;
+        if (i)
+            fputc(',', fh);
+        if (j - i == 1) {
+            fputs(h, fh);
+            continue;
+        }
+        grp_digits(h, &s, &e);
+        fprintf(fh, "%.*s[", (int)s, h);
+        /* the suffix follows the number, whatever its width */
+        e = s + digits(h + s);
+        for (k = i; k < j; k = b) {
+            a = strtol(grp->hosts[k] + s, NULL, 10);
+            for (b = k + 1; b < j &&
+                strtol(grp->hosts[b] + s, NULL, 10) == a + (b - k); b++)
+                ;
+            if (k != i)
+                fputc(',', fh);
+            fprintf(fh, "%.*s", digits(grp->hosts[k] + s),
+                grp->hosts[k] + s);
+            if (b - k > 1)
+                fprintf(fh, "-%.*s", digits(grp->hosts[b - 1] + s),
+                    grp->hosts[b - 1] + s);
+        }
+        fprintf(fh, "]%s", h + e);
+    }
+}
+
+/*
+ * print every distinct output once, with the list of
+ * hosts that produced it, and free the groups
+ */
+void
+group_print(void)
+{
+    struct group *grp;
+    struct group *next;
+    char         *p;
+    char         *nl;
+    char         *end;
+    int           i;
+
+    for (grp = grp_first; grp; grp = next) {
+        next = grp->next;
+
+        fputs("----------------\n", stdout);
+        grp_printhosts(stdout, grp);
+        fprintf(stdout, " (%d)\n----------------\n", grp->nhosts);
+
+        end = grp->data + grp->len;
+        for (p = grp->data; p < end; p = nl + 1) {
+            nl = memchr(p + 1, '\n', end - p - 1);
+            fprintf(stdout, "%s %.*s\n",
+                *p == ERR ? pfx_err[out_tty + 1] : pfx_out[out_tty + 1],
+                (int)(nl - p - 1), p + 1);
+        }
+        if (grp->ret < 0)
+            fprintf(stdout, "%s timeout\n", pfx_crt[out_tty]);
+        else if (grp->ret == 255)
+            fprintf(stdout, "%s ssh failure\n", pfx_crt[out_tty]);
+        else if (print_exit)
+            fprintf(stdout, "%s %d\n",
+                pfx_ret[out_tty ? (grp->ret ? 2 : 1) : 0], grp->ret);
+
+        for (i = 0; i < grp->nhosts; i++)
+            free(grp->hosts[i]);
+        free(grp->hosts);
+        free(grp->data);
+        free(grp);
+    }
+    grp_first = grp_last = grp_top = NULL;
+    memset(grphash, 0, sizeof(grphash));
+    fflush(stdout);
+}
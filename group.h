@@ -0,0 +1,64 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define GRPHASH  4096   /* group hash buckets */
+
+/*
+ * a distinct output, stored once for all the hosts that
+ * produced it. data is a sequence of records: the stream
+ * (OUT or ERR) as one byte, the line and a newline.
+ */
+struct
+group {
+    uint64_t      hash;
+    int           ret;          /* -1 for timed out sessions */
+    char         *data;
+    size_t        len;
+    char        **hosts;
+    int           nhosts;
+    int           cap;
+    struct group *hnext;        /* hash chain */
+    struct group *next;         /* in order of appearance */
+};
+
+/*
+ * per slot grouping state. while the output of a slot
+ * matches the output of the candidate group nothing is
+ * copied, only the offset advances. on the first
+ * difference the matched part is copied to the slot's own
+ * buffer, and the rest of the output is appended there.
+ */
+struct
+grpstate {
+    uint64_t      hash;
+    struct group *cand;
+    size_t        off;
+    int           own;
+    char         *buf;
+    size_t        len;
+    size_t        cap;
+};
@@ -25,84 +25,79 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/uio.h>
 #include "mpssh.h"
 #include "host.h"
 
 /*
- * routine for allocating a new host element in the
- * linked list containing the hosts read from the file.
- * it is used internally by host_add().
+ * the compiled host list, either built by the parser or
+ * mapped from the cache. the hosts are handed out one at a
+ * time by host_next(), patterns are expanded as they go, so
+ * the full list is never built.
  */
-static struct host*
-host_new(char *user, char *host, uint16_t port)
-{
-    static struct host *hst;
-
-    if (!(hst = calloc(1, sizeof(struct host)))) goto fail;
-
-    if (user) {
-        hst->user = calloc(1, strlen(user)+1);
-        if (hst->user == NULL)
-            goto fail;
-        strncpy(hst->user, user, strlen(user));
-    } else {
-        hst->user = NULL;
-    }
-
-    if (host) {
-        hst->host = calloc(1, strlen(host)+1);
-        if (hst->host == NULL)
-            goto fail;
-        strncpy(hst->host, host, strlen(host));
-    } else {
-        hst->host = NULL;
-    }
-
-    hst->port = port;
+static struct hostidx    hidx;
+static char             *strtab_mem = NULL;
+static void             *cache_map = NULL;
+static size_t            cache_len = 0;
 
-    hst->next = NULL;
+/* hosts given on the command line, one per line */
+static char             *hostargs = NULL;
+static size_t            hostargslen = 0;
 
-    return(hst);
-fail:
-    perr("Can't alloc mem in %s\n", __func__);
+/* the label expression and the candidate records */
+static char             *termbuf = NULL;
+static struct hostterm  *terms = NULL;
+static int               nterms = 0;
+static struct hostrange *ranges = NULL;
+static int               nranges = 0;
 
-    if (hst != NULL) {
-        if (hst->user != NULL)
-            free(hst->user);
-        if (hst->host != NULL)
-            free(hst->host);
-        free(hst);
-    }
+/*
+ * a host list streamed from a pipe is read as the hosts are
+ * needed, one line at a time, instead of being indexed
+ */
+static int               stream = 0;
+static int               stream_eof = 0;
+static int               stream_fl;
+static int               stream_take = 1;   /* current label selected */
+static char             *streambuf = NULL;
+static size_t            stream_off = 0;
+static size_t            stream_len = 0;
+static size_t            stream_cap = 0;
+static struct evsrc      stream_src = { HOSTS, NULL };
 
-    exit(1);
-}
+/* iterator state */
+static int               it_range;
+static int               it_term;
+static uint32_t          it_rec;
+static uint32_t          it_end;
+static int               it_inpat;
+static struct hostpat    it_pat;
+static char              it_name[MAXNAME + 1];
 
 /*
- * routine for adding elements in the existing hostlist
- * linked list.
+ * characters allowed in a host line, as the old sscanf set,
+ * plus the pattern ones. 2 is only allowed inside brackets.
  */
-static struct host*
-host_add(struct host *hst, char *user, char *host, uint16_t port)
-{
-    if (hst == NULL)
-        return(host_new(user, host, port));
+static unsigned char hostchr[256];
 
-    hst->next = host_add(hst->next, user, host, port);
-    return(hst->next);
-}
+/* string table the label sort compares against */
+static char *idx_sortstr;
+
+int mkpath(char *, mode_t);
 
-static FILE*
-host_openfile(char *fname)
+static int
+host_openfile(char **fnamep)
 {
     int   fnamelen;
+    int   fd;
     char *home;
-    FILE *hstlist;
+    char *fname = *fnamep;
 
     if (fname == NULL) {
         home = getenv("HOME");
         if (!home) {
             perr("Can't get HOME env var in %s\n", __func__);
-            return NULL;
+            return -1;
         }
 
         fnamelen = strlen(home) + strlen("/"HSTLIST) + 1;
@@ -111,187 +106,1318 @@ host_openfile(char *fname)
 
         if (!fname) {
             perr("Can't alloc mem in %s\n", __func__);
-            return NULL;
+            return -1;
         }
 
         sprintf(fname, "%s/"HSTLIST, home);
+        *fnamep = fname;
 
     } else if (strcmp(fname, "-") == 0) {
 
-        fname = calloc(1, strlen("stdin")+1);
-
-        if (!fname) {
-            perr("Can't alloc mem in %s\n", __func__);
-            return NULL;
-        }
-
-        sprintf(fname, "stdin");
-
-        hstlist = stdin;
-
         if (verbose)
             fprintf(stdout, "Reading hosts from : stdin\n");
 
-        goto out;
+        return 0;
     }
 
     if (verbose)
         fprintf(stdout, "Reading hosts from : %s\n", fname);
 
-    hstlist = fopen(fname, "r");
+    fd = open(fname, O_RDONLY | O_CLOEXEC);
 
-    if (!hstlist)
+    if (fd < 0)
         perr("Can't open file: %s (%s) in %s\n",
             fname, strerror(errno), __func__);
-out:
-    return hstlist;
+
+    return fd;
 }
 
 /*
- * routine that reads the host from a file and puts them
- * in the hostlist linked list using the above two routines
+ * get the whole host list in memory. regular files are
+ * mapped, pipes and terminals are read in large blocks.
+ * *mapped tells how to release the buffer.
  */
-struct host*
-host_readlist(char *fname)
+static char*
+host_loadfile(int fd, size_t *len, int *mapped)
 {
-    FILE   *hstlist;
-    struct  host *hst;
-    struct  host *hst_head;
-    char    line[MAXNAME*3];
-    int     i;
-    int     linelen;
-    u_long  port;
-    char   *login = NULL;
-    char   *hostname = NULL;
-    char   *llabel = NULL;
+    struct stat st;
+    char       *buf;
+    size_t      size;
+    size_t      cap;
+    ssize_t     n;
 
-    hstlist = host_openfile(fname);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            madvise(buf, st.st_size, MADV_SEQUENTIAL);
+            *len = st.st_size;
+            *mapped = 1;
+            return(buf);
+        }
+    }
 
-    if (hstlist == NULL)
-        exit(1);
+    *mapped = 0;
+    size = 0;
+    cap = HOSTCHUNK;
+    buf = malloc(cap);
+    for (;;) {
+        if (buf == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+        n = read(fd, buf + size, cap - size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        size += n;
+        if (size == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    *len = size;
+    return(buf);
+}
 
-    hst_head = hst = host_add(NULL, NULL, NULL, 0);
+/*
+ * make room for n more elements of size sz in *arr
+ */
+static void
+idx_grow(void *arr, uint32_t *cap, uint32_t used, size_t n, size_t sz)
+{
+    void **ap = arr;
 
-    if (hst_head == NULL) {
-        perr("Unable to add host structure head in %s\n", __func__);
+    if (used + n <= *cap)
+        return;
+    if (*cap == 0)
+        *cap = 4096;
+    while (*cap < used + n)
+        *cap *= 2;
+    *ap = realloc(*ap, (size_t)*cap * sz);
+    if (*ap == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
         exit(1);
     }
+}
 
-    while (fgets(line, sizeof(line), hstlist)) {
+static uint32_t
+idx_addstr(struct hostidx *idx, const char *s, size_t len)
+{
+    uint32_t off;
 
-        if (sscanf(line, "%[A-Za-z0-9-.@:%]", line) != 1)
-            continue;
+    idx_grow(&idx->strtab, &idx->strcap, idx->strsize, len + 1, 1);
+    off = idx->strsize;
+    memcpy(idx->strtab + off, s, len);
+    idx->strtab[off + len] = '\0';
+    idx->strsize += len + 1;
+    return(off);
+}
+
+static int
+idx_labelcmp(const void *a, const void *b)
+{
+    const struct hostlabel *x = a;
+    const struct hostlabel *y = b;
+    int r;
+
+    r = strcmp(idx_sortstr + x->name, idx_sortstr + y->name);
+    if (r)
+        return(r);
+    return(x->first < y->first ? -1 : (x->first > y->first));
+}
+
+/*
+ * number of chars of v printed zero padded to width
+ */
+static size_t
+host_numlen(u_long v, int width)
+{
+    size_t n;
+
+    for (n = 1; v >= 10; v /= 10)
+        n++;
+    return(n > (size_t)width ? n : (size_t)width);
+}
+
+/*
+ * parse a run of at most 18 digits
+ */
+static const char*
+host_patnum(const char *p, const char *end, u_long *v, size_t *len)
+{
+    const char *q = p;
+
+    for (*v = 0; p < end && isdigit((unsigned char)*p); p++)
+        *v = *v * 10 + (*p - '0');
+    *len = p - q;
+    return(*len == 0 || *len > 18 ? NULL : p);
+}
+
+/*
+ * compile a host pattern like web[01-20,35].dc[1-3]. returns
+ * the number of hosts it expands to and the longest of their
+ * names, or 0 if the pattern is invalid.
+ */
+static uint64_t
+host_patcomp(struct hostpat *pat, const char *s, size_t len, size_t *maxlen)
+{
+    const char      *end = s + len;
+    const char      *p;
+    struct hpatgrp  *g;
+    struct hpatitem *it;
+    uint64_t         count = 1;
+    uint64_t         n;
+    size_t           w;
+    size_t           wmax;
+
+    pat->ngrp = 0;
+    *maxlen = 0;
+    for (;;) {
+        for (p = s; p < end && *p != '['; p++)
+            if (*p == ']')
+                return(0);
+        pat->lit[pat->ngrp] = s;
+        pat->litlen[pat->ngrp] = p - s;
+        *maxlen += p - s;
+        if (p == end)
+            break;
+
+        if (pat->ngrp == HPAT_GROUPS)
+            return(0);
+        g = &pat->grp[pat->ngrp++];
+        g->nitems = 0;
+        wmax = 0;
+        n = 0;
+        /* comma separated numbers and ranges */
+        do {
+            if (g->nitems == HPAT_ITEMS)
+                return(0);
+            it = &g->item[g->nitems++];
+            if ((p = host_patnum(p + 1, end, &it->lo, &w)) == NULL)
+                return(0);
+            /* a leading zero asks for zero padding */
+            it->width = (w > 1 && p[-w] == '0') ? w : 0;
+            it->hi = it->lo;
+            if (p < end && *p == '-' &&
+                (p = host_patnum(p + 1, end, &it->hi, &w)) == NULL)
+                return(0);
+            if (it->hi < it->lo || p == end)
+                return(0);
+            w = host_numlen(it->hi, it->width);
+            if (w > wmax)
+                wmax = w;
+            n += it->hi - it->lo + 1;
+        } while (*p == ',');
+        if (*p != ']')
+            return(0);
+
+        count *= n;
+        if (count > INT_MAX)
+            return(0);
+        *maxlen += wmax;
+        s = p + 1;
+    }
+    if (*maxlen > MAXNAME)
+        return(0);
+    return(count);
+}
+
+static void
+host_patreset(struct hostpat *pat)
+{
+    int i;
+
+    for (i = 0; i < pat->ngrp; i++) {
+        pat->grp[i].cur = 0;
+        pat->grp[i].val = pat->grp[i].item[0].lo;
+    }
+}
+
+/*
+ * print the current name of the pattern in buf
+ */
+static size_t
+host_patname(struct hostpat *pat, char *buf)
+{
+    struct hpatgrp *g;
+    size_t          len = 0;
+    int             i;
+
+    for (i = 0; i <= pat->ngrp; i++) {
+        memcpy(buf + len, pat->lit[i], pat->litlen[i]);
+        len += pat->litlen[i];
+        if (i == pat->ngrp)
+            break;
+        g = &pat->grp[i];
+        len += sprintf(buf + len, "%0*lu", g->item[g->cur].width, g->val);
+    }
+    buf[len] = '\0';
+    return(len);
+}
+
+/*
+ * move to the next name, returns 0 after the last one
+ */
+static int
+host_patnext(struct hostpat *pat)
+{
+    struct hpatgrp *g;
+    int             i;
+
+    for (i = pat->ngrp - 1; i >= 0; i--) {
+        g = &pat->grp[i];
+        if (g->val < g->item[g->cur].hi) {
+            g->val++;
+            return(1);
+        }
+        if (g->cur + 1 < g->nitems) {
+            g->val = g->item[++g->cur].lo;
+            return(1);
+        }
+        g->cur = 0;
+        g->val = g->item[0].lo;
+    }
+    return(0);
+}
+
+/*
+ * check if the pattern, from range g on, expands to name
+ */
+static int
+host_patmatch(struct hostpat *pat, int g, const char *name, size_t len)
+{
+    struct hpatgrp  *grp;
+    struct hpatitem *it;
+    u_long           v;
+    size_t           k;
+
+    if (len < pat->litlen[g] || memcmp(name, pat->lit[g], pat->litlen[g]))
+        return(0);
+    name += pat->litlen[g];
+    len -= pat->litlen[g];
+    if (g == pat->ngrp)
+        return(len == 0);
 
-        linelen = strlen(line);
+    /* try every run of leading digits */
+    grp = &pat->grp[g];
+    for (k = 0, v = 0; k < len && k < 18 &&
+        isdigit((unsigned char)name[k]); ) {
+        v = v * 10 + (name[k++] - '0');
+        for (it = grp->item; it < grp->item + grp->nitems; it++)
+            if (v >= it->lo && v <= it->hi &&
+                host_numlen(v, it->width) == k &&
+                host_patmatch(pat, g + 1, name + k, len - k))
+                return(1);
+    }
+    return(0);
+}
+
+/*
+ * parse the host list into the index, in a single pass.
+ * every line is [user@]host[:port] or %label, only the
+ * leading run of allowed characters counts.
+ */
+static void
+host_parse(char *buf, size_t len, struct hostidx *idx)
+{
+    int     i;
+    int     inlabel = 0;
+    int     depth;
+    char   *p;
+    char   *end;
+    char   *eol;
+    char   *tok;
+    char   *tokend;
+    char   *at;
+    char   *colon;
+    char   *hostname;
+    u_long  port;
+    size_t  ulen;
+    size_t  hlen;
+    size_t  maxlen;
+    int     flags;
+    struct  hostrec   *r;
+    struct  hostlabel *l = NULL;
+    struct  hostpat    pat;
+
+    if (!hostchr['a']) {
+        for (i = 0; i < 256; i++)
+            hostchr[i] = isalnum(i) || strchr("-.@:%[]", i) != NULL;
+        hostchr[','] = 2;
+        hostchr[0] = 0;
+    }
+
+    /* start over, but keep the buffers for the next call */
+    idx->nrecs = idx->nlabels = idx->nolabel = idx->strsize = 0;
+
+    for (p = buf, end = buf + len; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+
+        /* the leading run of allowed chars is the entry */
+        tok = p;
+        for (tokend = tok, depth = 0; tokend < eol; tokend++) {
+            i = hostchr[(unsigned char)*tokend];
+            if (i == 0 || (i == 2 && depth == 0))
+                break;
+            depth += (*tokend == '[') - (*tokend == ']');
+        }
+        if (tokend == tok)
+            continue;
 
         /* label support */
-        if (line[0] == '%') {
-            if (llabel)
-                free(llabel);
-            llabel = calloc(1, linelen + 1);
-            if (llabel == NULL) {
-                perr("Can't alloc mem in %s\n", __func__);
-                exit(1);
-            }
-            strncpy(llabel, &line[1], linelen);
+        if (*tok == '%') {
+            idx_grow(&idx->labels, &idx->labelcap, idx->nlabels, 1,
+                sizeof(struct hostlabel));
+            l = &idx->labels[idx->nlabels++];
+            l->len = tokend - tok - 1;
+            l->name = idx_addstr(idx, tok + 1, l->len);
+            l->first = idx->nrecs;
+            l->count = 0;
+            inlabel = 1;
             continue;
         }
 
-        hostname = line;
-        login = NULL;
+        /* [user@]host[:port] */
+        ulen = 0;
+        hostname = tok;
+        at = memchr(tok, '@', tokend - tok);
+        if (at) {
+            if (at == tok)
+                continue;
+            ulen = at - tok;
+            hostname = at + 1;
+        }
         port = NON_DEFINED_PORT;
+        colon = memchr(hostname, ':', tokend - hostname);
+        hlen = (colon ? colon : tokend) - hostname;
+        if (colon) {
+            /* the last colon wins, as it always did */
+            for (colon = tokend - 1; *colon != ':'; colon--)
+                ;
+            for (port = 0, colon++; colon < tokend &&
+                isdigit((unsigned char)*colon) && port <= UINT16_MAX; colon++)
+                port = port * 10 + (*colon - '0');
+        }
 
-        /* XXX: This is ugly */
-        for (i=0; i < linelen; i++) {
-            switch (line[i]) {
-                case '@':
-                    if (login)
-                        break;
-                    line[i] = '\0';
-                    if (strlen(line))
-                        login = line;
-                    else
-                        break;
-                    hostname = &line[i+1];
-                    break;
-                case ':':
-                    line[i] = '\0';
-                    port = strtol(&line[i+1],
-                        (char **)NULL, 10);
-                    break;
-                default:
-                    break;
+        /*
+         * names longer than MAXNAME are dropped, as patterns are,
+         * and so are ports that do not fit in 16 bits
+         */
+        if (hlen == 0 || hlen > MAXNAME || ulen > UINT16_MAX ||
+            port > UINT16_MAX)
+            continue;
+
+        /* a pattern is kept as is and expanded when it is used */
+        flags = 0;
+        if (memchr(hostname, '[', hlen) || memchr(hostname, ']', hlen)) {
+            if (host_patcomp(&pat, hostname, hlen, &maxlen) == 0)
+                continue;
+            flags = HREC_RANGE;
+        }
+
+        idx_grow(&idx->recs, &idx->reccap, idx->nrecs, 1,
+            sizeof(struct hostrec));
+        r = &idx->recs[idx->nrecs++];
+        r->user = at ? idx_addstr(idx, tok, ulen) : HIDX_NOUSER;
+        r->host = idx_addstr(idx, hostname, hlen);
+        r->port = port;
+        r->ulen = ulen;
+        r->hlen = hlen;
+        r->flags = flags;
+
+        if (inlabel)
+            l->count++;
+        else
+            idx->nolabel++;
+    }
+
+    idx_sortstr = idx->strtab;
+    qsort(idx->labels, idx->nlabels, sizeof(struct hostlabel),
+        idx_labelcmp);
+}
+
+/*
+ * name of the cache file for a host list, under ~/.mpssh/cache
+ * and named after a hash of the list's full path
+ */
+static char*
+host_cachepath(char *fname)
+{
+    char     *home;
+    char     *path;
+    char      real[PATH_MAX];
+    uint64_t  h = 0xcbf29ce484222325ULL;
+    size_t    len;
+    unsigned char *p;
+
+    home = getenv("HOME");
+    if (!home || !realpath(fname, real))
+        return(NULL);
+
+    for (p = (unsigned char *)real; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+
+    len = strlen(home) + strlen("/"CACHEDIR) + 22;
+    path = malloc(len);
+    if (path == NULL)
+        return(NULL);
+    snprintf(path, len, "%s/"CACHEDIR, home);
+    if (mkpath(path, 0700)) {
+        free(path);
+        return(NULL);
+    }
+    snprintf(path, len, "%s/"CACHEDIR"/%016llx", home,
+        (unsigned long long)h);
+    return(path);
+}
+
+/*
+ * hash of the host list contents, a word at a time. the
+ * file identity alone misses the edits that keep the size
+ * and put the mtime back, as touch -r or rsync -t do.
+ */
+static uint64_t
+host_filehash(const char *buf, size_t len)
+{
+    uint64_t h = len;
+    uint64_t w;
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        memcpy(&w, buf, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    w = 0;
+    memcpy(&w, buf, len);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    return(h);
+}
+
+static int
+host_cachefresh(struct hostidx_hdr *hdr, struct stat *st, uint64_t hash)
+{
+    return(!memcmp(hdr->magic, HIDX_MAGIC, sizeof(hdr->magic)) &&
+        hdr->size == (uint64_t)st->st_size &&
+        hdr->mtime_sec == st->st_mtim.tv_sec &&
+        hdr->mtime_nsec == st->st_mtim.tv_nsec &&
+        hdr->ino == st->st_ino &&
+        hdr->dev == st->st_dev &&
+        hdr->hash == hash);
+}
+
+/*
+ * true if the string at off is inside the table and ends
+ * with a nul right at its recorded length
+ */
+static int
+host_cachestr(struct hostidx *idx, uint32_t off, size_t len)
+{
+    return((uint64_t)off + len < idx->strsize && idx->strtab[off + len] == '\0');
+}
+
+/*
+ * check every offset and length of a mapped index, the file
+ * could be cut short or garbled by anything. returns 0 if
+ * the index can be used as is.
+ */
+static int
+host_cachecheck(struct hostidx *idx)
+{
+    struct hostrec   *r;
+    struct hostlabel *l;
+    struct hostpat    pat;
+    size_t            maxlen;
+
+    if (idx->nolabel > idx->nrecs)
+        return(-1);
+    for (r = idx->recs; r < idx->recs + idx->nrecs; r++) {
+        if (r->hlen == 0 || r->hlen > MAXNAME ||
+            !host_cachestr(idx, r->host, r->hlen))
+            return(-1);
+        if (r->user != HIDX_NOUSER && !host_cachestr(idx, r->user, r->ulen))
+            return(-1);
+        if ((r->flags & HREC_RANGE) &&
+            host_patcomp(&pat, idx->strtab + r->host, r->hlen, &maxlen) == 0)
+            return(-1);
+    }
+    for (l = idx->labels; l < idx->labels + idx->nlabels; l++) {
+        if (!host_cachestr(idx, l->name, l->len) ||
+            (uint64_t)l->first + l->count > idx->nrecs)
+            return(-1);
+    }
+    return(0);
+}
+
+/*
+ * map the cached index if it was compiled from this very
+ * version of the source file, with these contents. returns
+ * 0 on success.
+ */
+static int
+host_loadcache(char *path, struct stat *src, uint64_t hash,
+    struct hostidx *idx)
+{
+    int                 fd;
+    char               *map;
+    size_t              need;
+    struct stat         st;
+    struct hostidx_hdr *hdr;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return(-1);
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct hostidx_hdr)) {
+        close(fd);
+        return(-1);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return(-1);
+
+    hdr = (struct hostidx_hdr *)map;
+    need = sizeof(struct hostidx_hdr) +
+        (size_t)hdr->nrecs * sizeof(struct hostrec) +
+        (size_t)hdr->nlabels * sizeof(struct hostlabel) + hdr->strsize;
+    if (!host_cachefresh(hdr, src, hash) || need != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return(-1);
+    }
+
+    memset(idx, 0, sizeof(struct hostidx));
+    idx->nrecs = hdr->nrecs;
+    idx->nlabels = hdr->nlabels;
+    idx->nolabel = hdr->nolabel;
+    idx->strsize = hdr->strsize;
+    idx->recs = (struct hostrec *)(hdr + 1);
+    idx->labels = (struct hostlabel *)(idx->recs + idx->nrecs);
+    idx->strtab = (char *)(idx->labels + idx->nlabels);
+    if (host_cachecheck(idx)) {
+        memset(idx, 0, sizeof(struct hostidx));
+        munmap(map, st.st_size);
+        return(-1);
+    }
+
+    cache_map = map;
+    cache_len = st.st_size;
+    return(0);
+}
+
+/*
+ * save the index, written to a temporary file and renamed
+ * over the old cache so that readers never see half of it
+ */
+static void
+host_savecache(char *path, struct stat *src, uint64_t hash,
+    struct hostidx *idx)
+{
+    int                fd;
+    char               tmp[PATH_MAX];
+    struct hostidx_hdr hdr;
+    struct iovec       iov[4];
+    ssize_t            n;
+    size_t             total;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HIDX_MAGIC, sizeof(hdr.magic));
+    hdr.size = src->st_size;
+    hdr.mtime_sec = src->st_mtim.tv_sec;
+    hdr.mtime_nsec = src->st_mtim.tv_nsec;
+    hdr.ino = src->st_ino;
+    hdr.dev = src->st_dev;
+    hdr.hash = hash;
+    hdr.nrecs = idx->nrecs;
+    hdr.nlabels = idx->nlabels;
+    hdr.nolabel = idx->nolabel;
+    hdr.strsize = idx->strsize;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = idx->recs;
+    iov[1].iov_len = (size_t)idx->nrecs * sizeof(struct hostrec);
+    iov[2].iov_base = idx->labels;
+    iov[2].iov_len = (size_t)idx->nlabels * sizeof(struct hostlabel);
+    iov[3].iov_base = idx->strtab;
+    iov[3].iov_len = idx->strsize;
+    total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + iov[3].iov_len;
+
+    n = writev(fd, iov, 4);
+    if (close(fd) || n != (ssize_t)total || rename(tmp, path))
+        unlink(tmp);
+}
+
+static uint32_t
+host_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261U;
+
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+    return(h);
+}
+
+/*
+ * find the sections of a label, [*lo, *hi) in the sorted labels
+ */
+static void
+host_findlabel(const char *name, uint32_t *lo, uint32_t *hi)
+{
+    uint32_t l = 0;
+    uint32_t h = hidx.nlabels;
+    uint32_t mid;
+
+    while (l < h) {
+        mid = (l + h) / 2;
+        if (strcmp(hidx.strtab + hidx.labels[mid].name, name) < 0)
+            l = mid + 1;
+        else
+            h = mid;
+    }
+    *lo = l;
+    while (l < hidx.nlabels && !strcmp(hidx.strtab + hidx.labels[l].name, name))
+        l++;
+    *hi = l;
+}
+
+/*
+ * build the host set of a label, referring to its records
+ */
+static void
+host_mkset(struct hostset *set, const char *name)
+{
+    struct hostlabel *l;
+    struct hostrec   *r;
+    uint32_t          lo, hi;
+    uint32_t          n = 0;
+    uint32_t          size = 2;
+    uint32_t          i;
+    size_t            maxlen;
+
+    host_findlabel(name, &lo, &hi);
+    for (l = &hidx.labels[lo]; l < &hidx.labels[hi]; l++)
+        n += l->count;
+    while (size < 2 * n)
+        size *= 2;
+
+    set->mask = size - 1;
+    set->slot = calloc(size, sizeof(uint32_t));
+    set->pats = NULL;
+    set->npats = 0;
+    if (set->slot == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+
+    for (l = &hidx.labels[lo]; l < &hidx.labels[hi]; l++) {
+        for (r = &hidx.recs[l->first]; r < &hidx.recs[l->first + l->count];
+            r++) {
+            if (r->flags & HREC_RANGE) {
+                set->pats = realloc(set->pats,
+                    (set->npats + 1) * sizeof(struct hostpat));
+                if (set->pats == NULL) {
+                    perr("Can't alloc mem in %s\n", __func__);
+                    exit(1);
+                }
+                host_patcomp(&set->pats[set->npats++],
+                    hidx.strtab + r->host, r->hlen, &maxlen);
+                continue;
             }
+            for (i = host_hash(hidx.strtab + r->host, r->hlen) & set->mask;
+                set->slot[i]; i = (i + 1) & set->mask)
+                ;
+            set->slot[i] = r - hidx.recs + 1;
         }
+    }
+}
 
-        if ((hostname == NULL) || (strlen(hostname) == 0))
+static int
+host_inset(struct hostset *set, const char *name, size_t len)
+{
+    struct hostrec *r;
+    uint32_t        i;
+
+    for (i = host_hash(name, len) & set->mask; set->slot[i];
+        i = (i + 1) & set->mask) {
+        r = &hidx.recs[set->slot[i] - 1];
+        if (r->hlen == len && !memcmp(hidx.strtab + r->host, name, len))
+            return(1);
+    }
+    for (i = 0; i < set->npats; i++)
+        if (host_patmatch(&set->pats[i], 0, name, len))
+            return(1);
+    return(0);
+}
+
+static void
+host_addrange(uint32_t first, uint32_t count, int term)
+{
+    ranges = realloc(ranges, (nranges + 1) * sizeof(struct hostrange));
+    if (ranges == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    ranges[nranges].first = first;
+    ranges[nranges].count = count;
+    ranges[nranges].term = term;
+    nranges++;
+}
+
+/*
+ * split the label expression, a comma separated list of labels
+ * to take the hosts of, and of -label and &label terms that
+ * exclude the hosts of the label or keep only the hosts that
+ * are also in it. returns the number of -label and &label terms.
+ */
+static int
+host_terms(void)
+{
+    char     *tok;
+    char     *last;
+    int       filters = 0;
+    struct hostterm *term;
+
+    if (!label)
+        return(0);
+
+    termbuf = strdup(label);
+    terms = calloc(strlen(label) + 1, sizeof(struct hostterm));
+    if (termbuf == NULL || terms == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    for (tok = strtok_r(termbuf, ",", &last); tok;
+        tok = strtok_r(NULL, ",", &last)) {
+        term = &terms[nterms];
+        term->op = '+';
+        if (*tok == '+' || *tok == '-' || *tok == '&')
+            term->op = *tok++;
+        if (*tok == '\0')
             continue;
+        term->name = tok;
+        if (term->op != '+')
+            filters++;
+        nterms++;
+    }
+    return(filters);
+}
+
+/*
+ * set up the candidate records for the label expression. the
+ * hosts before the first label are always candidates, and
+ * without labels to take the hosts of, all hosts are. the
+ * hosts are matched by their host name.
+ */
+static void
+host_select(void)
+{
+    int       t;
+    int       lastinc = -1;
+    uint32_t  lo, hi;
+    struct hostterm *term;
 
-        errno = 0;
+    for (t = 0; t < nterms; t++)
+        if (terms[t].op == '+')
+            lastinc = t;
 
-        if (!login)
-            login = user;
+    if (lastinc < 0)
+        host_addrange(0, hidx.nrecs, -1);
+    else
+        host_addrange(0, hidx.nolabel, -1);
 
-        /* check if labels match */
-        if (label && llabel) {
-            if (strcmp(llabel, label))
+    for (t = 0; t < nterms; t++) {
+        term = &terms[t];
+        if (term->op == '+') {
+            host_findlabel(term->name, &lo, &hi);
+            for (; lo < hi; lo++)
+                host_addrange(hidx.labels[lo].first,
+                    hidx.labels[lo].count, t);
+        }
+        /* the earlier labels are needed to skip the duplicates */
+        if (term->op != '+' || t < lastinc) {
+            host_mkset(&term->set, term->name);
+            term->hasset = 1;
+        }
+    }
+}
+
+/*
+ * check the host against the label expression
+ */
+static int
+host_match(const char *name, size_t len)
+{
+    struct hostterm *term;
+    int              t;
+
+    for (t = 0; t < nterms; t++) {
+        term = &terms[t];
+        switch (term->op) {
+            case '-':
+                if (host_inset(&term->set, name, len))
+                    return(0);
+                break;
+            case '&':
+                if (!host_inset(&term->set, name, len))
+                    return(0);
+                break;
+            default:
+                /* already taken from an earlier label */
+                if (t < it_term && host_inset(&term->set, name, len))
+                    return(0);
+                break;
+        }
+    }
+    return(1);
+}
+
+static void
+host_rewind(void)
+{
+    it_range = 0;
+    it_rec = it_end = 0;
+    it_inpat = 0;
+}
+
+/*
+ * check if the hosts of a label are selected, when streaming
+ */
+static int
+host_wanted(const char *name)
+{
+    int t;
+
+    if (!label)
+        return(1);
+    for (t = 0; t < nterms; t++)
+        if (!strcmp(terms[t].name, name))
+            return(1);
+    return(0);
+}
+
+/*
+ * parse the next line of the streamed host list, reading more
+ * of it as needed. returns 1 with the iterator on the host of
+ * the line, or 0 if there is no complete line yet or at eof.
+ */
+static int
+host_streamline(void)
+{
+    char    *line;
+    char    *eol;
+    size_t   len;
+    ssize_t  n;
+
+    for (;;) {
+        line = streambuf + stream_off;
+        len = stream_len - stream_off;
+        eol = memchr(line, '\n', len);
+        if (eol == NULL && !stream_eof) {
+            /* keep the partial line and read after it */
+            memmove(streambuf, line, len);
+            stream_off = 0;
+            stream_len = len;
+            if (stream_len == stream_cap) {
+                stream_cap *= 2;
+                streambuf = realloc(streambuf, stream_cap);
+                if (streambuf == NULL) {
+                    perr("Can't alloc mem in %s\n", __func__);
+                    exit(1);
+                }
+            }
+            n = read(0, streambuf + stream_len, stream_cap - stream_len);
+            if (n < 0 && errno == EINTR)
                 continue;
+            if (n < 0 && errno == EAGAIN)
+                return(0);
+            if (n <= 0)
+                stream_eof = 1;
+            else
+                stream_len += n;
+            continue;
+        }
+        if (eol == NULL) {
+            /* the last line may not be terminated */
+            if (len == 0)
+                return(0);
+            stream_off = stream_len;
+        } else {
+            len = eol - line;
+            stream_off += len + 1;
         }
 
-        /* add the host record */
-        hst = host_add(hst, login, hostname, (uint16_t)port);
+        host_parse(line, len, &hidx);
+        if (hidx.nlabels) {
+            stream_take = host_wanted(hidx.strtab + hidx.labels[0].name);
+            continue;
+        }
+        if (hidx.nrecs && stream_take) {
+            it_rec = 0;
+            it_end = 1;
+            it_term = -1;
+            return(1);
+        }
+    }
+}
 
-        if (hst == NULL) {
-            perr("Unable to add member to "
-                "the host struct in %s\n", __func__);
-            exit(1);
+/*
+ * there may be more hosts coming on the streamed host list
+ */
+int
+host_pending(void)
+{
+    return(stream && (!stream_eof || stream_off < stream_len));
+}
+
+/*
+ * watch the streamed host list in the event loop, the
+ * event only wakes the loop up, host_next() reads it
+ */
+void
+host_watch(void)
+{
+    struct epoll_event ev;
+
+    if (!stream)
+        return;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &stream_src;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, 0, &ev) < 0) {
+        perr("Can't watch stdin: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+ * step to the next selected host, returns its name and
+ * record, expanding the patterns one name at a time
+ */
+static const char*
+host_step(struct hostrec **rp, size_t *len)
+{
+    struct hostrec *r;
+    const char     *name;
+    size_t          maxlen;
+
+    for (;;) {
+        if (it_inpat) {
+            r = &hidx.recs[it_rec];
+            *len = host_patname(&it_pat, it_name);
+            name = it_name;
+            if (!host_patnext(&it_pat)) {
+                it_inpat = 0;
+                it_rec++;
+            }
+        } else {
+            while (it_rec == it_end) {
+                if (it_range == nranges) {
+                    if (stream && host_streamline())
+                        break;
+                    return(NULL);
+                }
+                it_rec = ranges[it_range].first;
+                it_end = it_rec + ranges[it_range].count;
+                it_term = ranges[it_range].term;
+                it_range++;
+            }
+            r = &hidx.recs[it_rec];
+            if (r->flags & HREC_RANGE) {
+                host_patcomp(&it_pat, hidx.strtab + r->host, r->hlen,
+                    &maxlen);
+                host_patreset(&it_pat);
+                it_inpat = 1;
+                continue;
+            }
+            name = hidx.strtab + r->host;
+            *len = r->hlen;
+            it_rec++;
+        }
+        if (nterms == 0 || host_match(name, *len)) {
+            *rp = r;
+            return(name);
         }
+    }
+}
 
-        /* keep track of the longest username */
-        if (login && strlen(login) > user_len_max)
-            user_len_max = strlen(login);
+/*
+ * count the selected hosts and find the longest username and
+ * hostname. a pattern is measured as a whole, without stepping
+ * through its names, unless the label expression has to match
+ * each name against the sets of its labels.
+ */
+static void
+host_measure(void)
+{
+    struct hostrec *r;
+    struct hostpat  pat;
+    const char     *name;
+    size_t          len;
+    size_t          ulen;
+    size_t          deflen;
+    uint64_t        count = 0;
+    uint32_t        i;
+    int             t;
 
-        /* keep track of the longest hostname */
-        if (strlen(hostname) > host_len_max)
-            host_len_max = strlen(hostname);
+    deflen = strlen(user);
+    for (t = 0; t < nterms && !terms[t].hasset; t++)
+        ;
 
-        hostcount++;
+    if (t < nterms) {
+        /* a dry run over the names, without keeping them */
+        while ((name = host_step(&r, &len)) != NULL) {
+            ulen = r->user == HIDX_NOUSER ? deflen : r->ulen;
+            if (ulen > (size_t)user_len_max)
+                user_len_max = ulen;
+            if (len > (size_t)host_len_max)
+                host_len_max = len;
+            count++;
+        }
+        host_rewind();
+    } else {
+        for (t = 0; t < nranges; t++) {
+            for (i = ranges[t].first;
+                i < ranges[t].first + ranges[t].count; i++) {
+                r = &hidx.recs[i];
+                ulen = r->user == HIDX_NOUSER ? deflen : r->ulen;
+                if (ulen > (size_t)user_len_max)
+                    user_len_max = ulen;
+                len = r->hlen;
+                if (r->flags & HREC_RANGE)
+                    count += host_patcomp(&pat, hidx.strtab + r->host,
+                        r->hlen, &len);
+                else
+                    count++;
+                if (len > (size_t)host_len_max)
+                    host_len_max = len;
+            }
+        }
     }
 
-    if (llabel)
-        free(llabel);
+    if (count > INT_MAX) {
+        perr("Too many hosts in the list\n");
+        exit(1);
+    }
+    hostcount = count;
+}
 
-    fclose(hstlist);
+/*
+ * hand out the next host to connect to, or NULL when done
+ */
+struct host*
+host_next(void)
+{
+    struct hostrec *r;
+    struct host    *hst;
+    const char     *name;
+    size_t          len;
+    size_t          ulen;
 
-    if (maxchld > hostcount)
-        maxchld = hostcount;
+    name = host_step(&r, &len);
+    if (name == NULL)
+        return(NULL);
 
-    hst = hst_head->next;
+    ulen = r->user == HIDX_NOUSER ? 0 : r->ulen + 1;
+    hst = malloc(sizeof(struct host) + len + 1 + ulen);
+    if (hst == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    hst->host = (char *)(hst + 1);
+    memcpy(hst->host, name, len);
+    hst->host[len] = '\0';
+    if (ulen) {
+        hst->user = hst->host + len + 1;
+        memcpy(hst->user, hidx.strtab + r->user, r->ulen);
+        hst->user[r->ulen] = '\0';
+    } else {
+        hst->user = user;
+    }
+    hst->port = r->port;
 
-    free(hst_head);
+    /* the streamed hosts are counted and measured as they come */
+    if (stream) {
+        ulen = ulen ? r->ulen : strlen(user);
+        if (ulen > (size_t)user_len_max)
+            user_len_max = ulen;
+        if (!host_width && len > (size_t)host_len_max)
+            host_len_max = len;
+        hostcount++;
+    }
 
     return(hst);
 }
 
 void
-host_free(struct host *hst)
+host_put(struct host *hst)
 {
-    struct host *next = NULL;
+    free(hst);
+}
 
-    if (hst == NULL)
-        return;
+/*
+ * add hosts from the command line, separated by commas
+ * or spaces, they are used instead of the host list file
+ */
+void
+host_addarg(char *arg)
+{
+    size_t len = strlen(arg);
+    int    depth = 0;
+    char  *p;
 
-    next = hst;
+    hostargs = realloc(hostargs, hostargslen + len + 1);
+    if (hostargs == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    for (p = hostargs + hostargslen; *arg; arg++, p++) {
+        depth += (*arg == '[') - (*arg == ']');
+        *p = (isspace((unsigned char)*arg) ||
+            (*arg == ',' && depth == 0)) ? '\n' : *arg;
+    }
+    *p = '\n';
+    hostargslen += len + 1;
+}
+
+/*
+ * routine that reads the hosts from a file or the command line
+ * and selects the ones to connect to, returns their number.
+ * a file is compiled into an index that is cached and reused
+ * until the file changes. a host list coming from a pipe is
+ * streamed instead, and -1 is returned as the number is not
+ * known yet.
+ */
+int
+host_readlist(char *fname)
+{
+    int             fd;
+    int             mapped;
+    char           *buf;
+    char           *cpath = NULL;
+    size_t          len;
+    uint64_t        hash = 0;
+    struct stat     st;
+    int             filters;
+
+    filters = host_terms();
+
+    if (hostargs) {
+        if (verbose)
+            fprintf(stdout, "Reading hosts from : command line\n");
+        host_parse(hostargs, hostargslen, &hidx);
+        strtab_mem = hidx.strtab;
+        goto select;
+    }
+
+    fd = host_openfile(&fname);
+
+    if (fd < 0)
+        exit(1);
+
+    /*
+     * stream the hosts from a pipe, unless the label expression
+     * needs to know all the labels up front
+     */
+    if (fd == 0 && !filters && fstat(fd, &st) == 0 &&
+        (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+        stream = 1;
+        stream_fl = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, stream_fl | O_NONBLOCK);
+        stream_cap = HOSTCHUNK;
+        streambuf = malloc(stream_cap);
+        if (streambuf == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+        user_len_max = strlen(user);
+        host_len_max = host_width;
+        return(-1);
+    }
+
+    if (fd > 0 && host_cache && fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        cpath = host_cachepath(fname);
+
+    /* the list is read either way, the cache saves the parsing */
+    buf = host_loadfile(fd, &len, &mapped);
+    if (cpath)
+        hash = host_filehash(buf, len);
 
-    while (next != NULL) {
-        hst = hst->next;
+    if (cpath && host_loadcache(cpath, &st, hash, &hidx) == 0) {
+        if (verbose)
+            fprintf(stdout, "Using cached host index : %s\n", cpath);
+    } else {
+        host_parse(buf, len, &hidx);
+        if (cpath)
+            host_savecache(cpath, &st, hash, &hidx);
+
+        /* the records point into the string table, keep it */
+        strtab_mem = hidx.strtab;
+    }
+    if (mapped)
+        munmap(buf, len);
+    else
+        free(buf);
+
+    if (fd)
+        close(fd);
+    free(cpath);
+
+select:
+    host_select();
 
-        if (next->host != NULL)
-            free(next->host);
-        if (next->user != NULL)
-            free(next->user);
+    host_measure();
+
+    if (host_width)
+        host_len_max = host_width;
+
+    if (maxchld > hostcount)
+        maxchld = hostcount;
+
+    return(hostcount);
+}
 
-        free(next);
-        next = hst;
+/*
+ * free the host index and the label expression
+ */
+void
+host_free(void)
+{
+    int i;
+
+    for (i = 0; i < nterms; i++) {
+        if (terms[i].hasset) {
+            free(terms[i].set.slot);
+            free(terms[i].set.pats);
+        }
+    }
+    free(termbuf);
+    free(terms);
+    free(ranges);
+    free(hostargs);
+
+    if (stream) {
+        fcntl(0, F_SETFL, stream_fl);
+        free(streambuf);
+    }
+
+    if (cache_map) {
+        munmap(cache_map, cache_len);
+        cache_map = NULL;
+    } else {
+        free(hidx.recs);
+        free(hidx.labels);
+        free(strtab_mem);
     }
 }
@@ -28,12 +28,140 @@
 #define MAXNAME    255 /* max hostname len */
 #define NON_DEFINED_PORT 0
 #define DEFAULT_PORT 22
+#define HOSTCHUNK  65536 /* host list read chunk */
+#define HPAT_GROUPS 8    /* bracket ranges in a host pattern */
+#define HPAT_ITEMS  32   /* comma separated items in a range */
 
-/* host list structs */
+/*
+ * a host handed out by host_next(), owned by the process
+ * slot that runs it and released with host_put()
+ */
 struct
 host {
     char        *user;
     char        *host;
     uint16_t     port;
-    struct host *next;
+};
+
+/*
+ * compiled host pattern such as web[01-20,35].dc[1-3],
+ * the literal parts around the ranges and the position
+ * of the expansion in each range, the last one is the
+ * one that moves fastest
+ */
+struct
+hpatitem {
+    u_long      lo;
+    u_long      hi;
+    int         width;              /* zero padded width, or 0 */
+};
+
+struct
+hpatgrp {
+    int         nitems;
+    int         cur;                /* expansion position */
+    u_long      val;
+    struct hpatitem item[HPAT_ITEMS];
+};
+
+struct
+hostpat {
+    int         ngrp;
+    const char *lit[HPAT_GROUPS + 1];
+    size_t      litlen[HPAT_GROUPS + 1];
+    struct hpatgrp grp[HPAT_GROUPS];
+};
+
+/* Cached host index dir, relative to users homedir */
+#define CACHEDIR     ".mpssh/cache"
+#define HIDX_MAGIC   "MPSSHIX3"
+#define HIDX_NOUSER  0xffffffff     /* use the default username */
+#define HREC_RANGE   0x1            /* host is a pattern */
+
+/*
+ * compiled host list. this is what the parser produces and
+ * what is saved in the cache, in native byte order, as the
+ * header, the records, the label sections and the string
+ * table, which holds nul terminated strings.
+ */
+struct
+hostrec {
+    uint32_t    user;               /* string offset or HIDX_NOUSER */
+    uint32_t    host;               /* string offset */
+    uint16_t    port;
+    uint16_t    ulen;
+    uint16_t    hlen;
+    uint16_t    flags;
+};
+
+/*
+ * a %label section, the records [first, first + count).
+ * sorted by name, then by position, so all the sections of
+ * a label are adjacent and can be found with a binary search.
+ */
+struct
+hostlabel {
+    uint32_t    name;               /* string offset */
+    uint32_t    len;
+    uint32_t    first;
+    uint32_t    count;
+};
+
+struct
+hostidx_hdr {
+    char        magic[8];
+    uint64_t    size;               /* source file identity */
+    int64_t     mtime_sec;
+    int64_t     mtime_nsec;
+    uint64_t    ino;
+    uint64_t    dev;
+    uint64_t    hash;               /* of the source contents */
+    uint32_t    nrecs;
+    uint32_t    nlabels;
+    uint32_t    nolabel;            /* records before the first label */
+    uint32_t    strsize;
+};
+
+struct
+hostidx {
+    struct hostrec   *recs;
+    struct hostlabel *labels;
+    char             *strtab;
+    uint32_t          nrecs;
+    uint32_t          nlabels;
+    uint32_t          nolabel;
+    uint32_t          strsize;
+    uint32_t          reccap;
+    uint32_t          labelcap;
+    uint32_t          strcap;
+};
+
+/*
+ * the hosts of a label, for the label expression tests:
+ * a hash of the plain host names, by record index + 1,
+ * and the compiled patterns
+ */
+struct
+hostset {
+    uint32_t       *slot;
+    uint32_t        mask;
+    struct hostpat *pats;
+    uint32_t        npats;
+};
+
+/* a term of the label expression */
+struct
+hostterm {
+    char            op;             /* '+', '-' or '&' */
+    char           *name;
+    int             hasset;
+    struct hostset  set;
+};
+
+/* a run of candidate records and the term that selected it */
+struct
+hostrange {
+    uint32_t        first;
+    uint32_t        count;
+    int             term;           /* -1 for the unlabeled hosts */
 };
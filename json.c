@@ -0,0 +1,310 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <errno.h>
+
+#include "mpssh.h"
+#include "host.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+#include "out.h"
+#include "json.h"
+
+void   outbuf_line(struct outbuf *, const char *, size_t, const char *, size_t);
+void   outbuf_flush(struct outbuf *);
+
+int    json_mode = 0;
+
+/* the last timestamp, the lines of a read share it */
+static __thread double  ts_last = -1;
+static __thread char    ts_buf[JSON_TSMAX];
+static __thread size_t  ts_len = 0;
+
+/* for the records too long for a batch, per thread */
+static __thread char   *jbuf = NULL;
+static __thread size_t  jcap = 0;
+
+/*
+ * what a byte needs in a string: 0 nothing, 1 a short
+ * escape, 2 a \u escape, 3 a check that it starts a valid
+ * utf-8 sequence
+ */
+static const unsigned char json_esc[256] = {
+    /* 0x00 - 0x1f, \b \t \n \f \r have short escapes */
+    2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 1, 1, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+    ['"'] = 1, ['\\'] = 1,
+    [0x80 ... 0xff] = 3,
+};
+
+static const char json_short[256] = {
+    ['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n', ['\f'] = 'f', ['\r'] = 'r',
+    ['"'] = '"', ['\\'] = '\\',
+};
+
+#define ONES    0x0101010101010101ULL
+#define HIGHS   0x8080808080808080ULL
+
+/* a byte of the word is zero, is less than n */
+#define HASZERO(w)      (((w) - ONES) & ~(w) & HIGHS)
+#define HASLESS(w, n)   (((w) - ONES * (n)) & ~(w) & HIGHS)
+
+/*
+ * the length of the valid utf-8 sequence at s, or 0
+ */
+static size_t
+utf8_len(const unsigned char *s, size_t n)
+{
+    unsigned int c = s[0];
+
+    if (c >= 0xc2 && c <= 0xdf)
+        return((n >= 2 && (s[1] & 0xc0) == 0x80) ? 2 : 0);
+    if (c >= 0xe0 && c <= 0xef) {
+        if (n < 3 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80)
+            return(0);
+        /* no overlong forms, no surrogates */
+        if ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] >= 0xa0))
+            return(0);
+        return(3);
+    }
+    if (c >= 0xf0 && c <= 0xf4) {
+        if (n < 4 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
+            (s[3] & 0xc0) != 0x80)
+            return(0);
+        if ((c == 0xf0 && s[1] < 0x90) || (c == 0xf4 && s[1] >= 0x90))
+            return(0);
+        return(4);
+    }
+    return(0);
+}
+
+/*
+ * escape len bytes of src as the inside of a JSON string,
+ * dst has room for JSON_ESCMAX * len. the plain ascii goes
+ * eight bytes at a time. returns the bytes written.
+ */
+static size_t
+json_escape(char *dst, const char *src, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    const unsigned char *end = s + len;
+    char    *d = dst;
+    uint64_t w;
+    size_t   n;
+
+    while (s < end) {
+        while (end - s >= 8) {
+            memcpy(&w, s, 8);
+            if (HASLESS(w, 0x20) | HASZERO(w ^ (ONES * '"')) |
+                HASZERO(w ^ (ONES * '\\')) | (w & HIGHS))
+                break;
+            memcpy(d, s, 8);
+            d += 8;
+            s += 8;
+        }
+        if (s == end)
+            break;
+        switch (json_esc[*s]) {
+        case 0:
+            *d++ = *s++;
+            break;
+        case 1:
+            *d++ = '\\';
+            *d++ = json_short[*s++];
+            break;
+        case 2:
+            d += sprintf(d, "\\u%04x", *s++);
+            break;
+        case 3:
+            if ((n = utf8_len(s, end - s)) != 0) {
+                memcpy(d, s, n);
+                d += n;
+                s += n;
+            } else {
+                memcpy(d, "\\ufffd", 6);
+                d += 6;
+                s++;
+            }
+            break;
+        }
+    }
+    return(d - dst);
+}
+
+/*
+ * seconds with six decimals, without going through printf
+ */
+static size_t
+json_ts(char *dst, double t)
+{
+    uint64_t us;
+    uint64_t sec;
+    char     tmp[24];
+    size_t   n = 0;
+    int      i;
+
+    us = (uint64_t)(t * 1e6 + 0.5);
+    sec = us / 1000000;
+    us %= 1000000;
+    do {
+        tmp[n++] = '0' + sec % 10;
+        sec /= 10;
+    } while (sec);
+    for (i = 0; i < (int)n; i++)
+        dst[i] = tmp[n - 1 - i];
+    dst[n++] = '.';
+    for (i = 5; i >= 0; i--) {
+        dst[n + i] = '0' + us % 10;
+        us /= 10;
+    }
+    return(n + 6);
+}
+
+/*
+ * the record heads of a slot. pfx[0] is the host part of
+ * every record, pfx[OUT] and pfx[ERR] go on to the stream
+ * and the timestamp of a line.
+ */
+void
+json_prefix(struct procslot *pslot)
+{
+    char   *buf;
+    char   *d;
+    size_t  hlen;
+    size_t  ulen;
+    size_t  size;
+    int     i;
+    static const char *stream[] = { NULL, "out", "err" };
+
+    hlen = strlen(pslot->hst->host);
+    ulen = strlen(pslot->hst->user);
+    size = 3 * (JSON_ESCMAX * (hlen + ulen) + 64);
+    if ((buf = malloc(size)) == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+
+    d = buf + sprintf(buf, "{\"host\":\"");
+    d += json_escape(d, pslot->hst->host, hlen);
+    d += sprintf(d, "\",\"user\":\"");
+    d += json_escape(d, pslot->hst->user, ulen);
+    if (pslot->hst->port != NON_DEFINED_PORT)
+        d += sprintf(d, "\",\"port\":%d", pslot->hst->port);
+    else
+        d += sprintf(d, "\",\"port\":null");
+    pslot->pfx[0] = buf;
+    pslot->pfxlen[0] = d - buf;
+
+    for (i = OUT; i <= ERR; i++) {
+        pslot->pfx[i] = d + 1;
+        pslot->pfxlen[i] = sprintf(pslot->pfx[i], "%s,\"stream\":\"%s\",\"ts\":",
+            pslot->pfx[0], stream[i]);
+        d = pslot->pfx[i] + pslot->pfxlen[i];
+    }
+}
+
+/*
+ * one line of output as a record. it is written straight
+ * into the batch, which is flushed first if the record
+ * might not fit. a record bigger than a whole batch is
+ * put together in the thread's own buffer.
+ */
+void
+json_line(struct outbuf *ob, struct procslot *pslot, int outfd,
+    const char *line, size_t len)
+{
+    char   *d;
+    char   *start;
+    size_t  worst;
+
+    worst = pslot->pfxlen[outfd] + JSON_TSMAX + 12 + JSON_ESCMAX * len;
+    if (worst > OUTBUF) {
+        if (worst > jcap) {
+            free(jbuf);
+            if ((jbuf = malloc(worst)) == NULL) {
+                perr("%s\n", strerror(errno));
+                exit(1);
+            }
+            jcap = worst;
+        }
+        start = jbuf;
+    } else {
+        if (ob->len + worst > OUTBUF)
+            outbuf_flush(ob);
+        start = ob->buf + ob->len;
+    }
+
+    d = start;
+    memcpy(d, pslot->pfx[outfd], pslot->pfxlen[outfd]);
+    d += pslot->pfxlen[outfd];
+    if (pslot->t_read != ts_last) {
+        ts_last = pslot->t_read;
+        ts_len = json_ts(ts_buf, ts_last);
+    }
+    memcpy(d, ts_buf, ts_len);
+    d += ts_len;
+    memcpy(d, ",\"line\":\"", 9);
+    d += 9;
+    d += json_escape(d, line, len);
+    *d++ = '"';
+    *d++ = '}';
+
+    if (start == jbuf) {
+        outbuf_line(ob, jbuf, d - jbuf, "", 0);
+        return;
+    }
+    *d++ = '\n';
+    ob->len = d - ob->buf;
+}
+
+/*
+ * the end of a session
+ */
+void
+json_exit(struct outbuf *ob, struct procslot *pslot)
+{
+    char    rec[256];
+    char   *d = rec;
+
+    d += sprintf(d, ",\"event\":\"exit\",\"ts\":");
+    d += json_ts(d, pslot->t_exit);
+    d += sprintf(d, ",\"exit\":%d,\"ssh_failure\":%s,\"timeout\":%s,"
+        "\"retry\":%s,\"attempt\":%d,\"duration\":%.6f}",
+        pslot->ret,
+        (pslot->ret == 255 && !pslot->timedout) ? "true" : "false",
+        pslot->timedout ? "true" : "false",
+        pslot->retry_in > 0 ? "true" : "false",
+        pslot->attempt,
+        pslot->t_exit - pslot->t_spawn);
+    outbuf_line(ob, pslot->pfx[0], pslot->pfxlen[0], rec, d - rec);
+}
@@ -0,0 +1,298 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mpssh.h"
+#include "host.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+#include "metrics.h"
+
+struct metrics          metrics;
+__thread struct metrics *thr_metrics = &metrics;
+
+static int              mt_sock = -1;
+static char            *mt_sockpath = NULL;
+static char            *mt_file = NULL;
+static double           mt_start;
+static double           mt_next;        /* next window */
+static struct metrics   mt_last;        /* counters at the last window */
+static double           mt_rate[5];     /* spawns, bytes and lines per sec */
+static struct evsrc     mt_src = { METRICS, NULL };
+static char             mt_buf[METRICSBUF];
+
+double mono_now(void);
+
+static void
+metrics_listen(char *path)
+{
+    struct sockaddr_un  sun;
+    struct stat         st;
+    struct epoll_event  ev;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        perr("metrics socket path too long: %s\n", path);
+        exit(1);
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    /* a socket left over by an earlier run */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    mt_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mt_sock < 0 ||
+        bind(mt_sock, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+        listen(mt_sock, 16) < 0) {
+        perr("Can't listen on metrics socket %s: %s\n", path,
+            strerror(errno));
+        exit(1);
+    }
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &mt_src;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, mt_sock, &ev) < 0) {
+        perr("Can't watch metrics socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    mt_sockpath = path;
+}
+
+void
+metrics_init(char *sockpath, char *file)
+{
+    mt_start = mt_next = mono_now();
+    mt_file = file;
+    if (sockpath)
+        metrics_listen(sockpath);
+}
+
+/*
+ * the label values come from the host list, quote the
+ * few chars that would break the format
+ */
+static size_t
+metrics_label(char *buf, size_t size, const char *s)
+{
+    size_t len = 0;
+
+    for (; *s && len + 2 < size; s++) {
+        if (*s == '"' || *s == '\\')
+            buf[len++] = '\\';
+        if ((unsigned char)*s >= 0x20)
+            buf[len++] = *s;
+    }
+    buf[len] = '\0';
+    return(len);
+}
+
+/*
+ * render the snapshot in mt_buf, returns its length
+ */
+static size_t
+metrics_snapshot(void)
+{
+    struct procslot *slow[METRICS_SLOW];
+    struct procslot *p;
+    double  now = mono_now();
+    long    queued;
+    size_t  len = 0;
+    int     nslow = 0;
+    int     i, j;
+    char    user[MAXNAME * 2];
+    char    host[MAXNAME * 2];
+
+#define MT_PRINTF(...) do { \
+    if (len < METRICSBUF) \
+        len += snprintf(mt_buf + len, METRICSBUF - len, __VA_ARGS__); \
+} while (0)
+
+    /* the hosts waiting for a retry are queued again */
+    queued = hostcount - (long)metrics.started + (long)metrics.retries;
+    if (queued < 0)
+        queued = 0;
+
+    MT_PRINTF("# TYPE mpssh_hosts gauge\n"
+        "mpssh_hosts{state=\"queued\"} %ld\n"
+        "mpssh_hosts{state=\"running\"} %d\n"
+        "mpssh_hosts{state=\"done\"} %d\n",
+        queued, children, done);
+    MT_PRINTF("# TYPE mpssh_hosts_done_total counter\n"
+        "mpssh_hosts_done_total{result=\"ok\"} %llu\n"
+        "mpssh_hosts_done_total{result=\"error\"} %llu\n"
+        "mpssh_hosts_done_total{result=\"ssh_failure\"} %llu\n"
+        "mpssh_hosts_done_total{result=\"timeout\"} %llu\n",
+        (unsigned long long)metrics.ok, (unsigned long long)metrics.errors,
+        (unsigned long long)metrics.sshfail,
+        (unsigned long long)metrics.timeouts);
+    MT_PRINTF("# TYPE mpssh_retries_total counter\n"
+        "mpssh_retries_total %llu\n",
+        (unsigned long long)metrics.retries);
+    MT_PRINTF("# TYPE mpssh_spawned_total counter\n"
+        "mpssh_spawned_total %llu\n"
+        "# TYPE mpssh_spawn_rate gauge\n"
+        "mpssh_spawn_rate %.1f\n",
+        (unsigned long long)metrics.started, mt_rate[0]);
+    MT_PRINTF("# TYPE mpssh_bytes_total counter\n"
+        "mpssh_bytes_total{stream=\"stdout\"} %llu\n"
+        "mpssh_bytes_total{stream=\"stderr\"} %llu\n"
+        "# TYPE mpssh_lines_total counter\n"
+        "mpssh_lines_total{stream=\"stdout\"} %llu\n"
+        "mpssh_lines_total{stream=\"stderr\"} %llu\n",
+        (unsigned long long)metrics.bytes[0],
+        (unsigned long long)metrics.bytes[1],
+        (unsigned long long)metrics.lines[0],
+        (unsigned long long)metrics.lines[1]);
+    MT_PRINTF("# TYPE mpssh_bytes_rate gauge\n"
+        "mpssh_bytes_rate{stream=\"stdout\"} %.0f\n"
+        "mpssh_bytes_rate{stream=\"stderr\"} %.0f\n"
+        "# TYPE mpssh_lines_rate gauge\n"
+        "mpssh_lines_rate{stream=\"stdout\"} %.0f\n"
+        "mpssh_lines_rate{stream=\"stderr\"} %.0f\n",
+        mt_rate[1], mt_rate[2], mt_rate[3], mt_rate[4]);
+    MT_PRINTF("# TYPE mpssh_elapsed_seconds gauge\n"
+        "mpssh_elapsed_seconds %.3f\n", now - mt_start);
+
+    /* the running hosts that were spawned first */
+    if ((p = ps) != NULL) do {
+        if (p->pid == 0)
+            continue;
+        for (j = nslow; j > 0 && slow[j - 1]->t_spawn > p->t_spawn; j--)
+            if (j < METRICS_SLOW)
+                slow[j] = slow[j - 1];
+        if (j < METRICS_SLOW) {
+            slow[j] = p;
+            if (nslow < METRICS_SLOW)
+                nslow++;
+        }
+    } while ((p = p->next) != ps);
+    MT_PRINTF("# TYPE mpssh_running_seconds gauge\n");
+    for (i = 0; i < nslow; i++) {
+        metrics_label(user, sizeof(user), slow[i]->hst->user);
+        metrics_label(host, sizeof(host), slow[i]->hst->host);
+        MT_PRINTF("mpssh_running_seconds{user=\"%s\",host=\"%s\"} %.3f\n",
+            user, host, now - slow[i]->t_spawn);
+    }
+#undef MT_PRINTF
+
+    return(len < METRICSBUF ? len : METRICSBUF - 1);
+}
+
+/*
+ * rewrite the textfile, through a rename so that the
+ * collector never reads half of it
+ */
+static void
+metrics_write(void)
+{
+    char    tmp[PATH_MAX];
+    size_t  len;
+    int     fd;
+
+    len = metrics_snapshot();
+    snprintf(tmp, sizeof(tmp), "%s.tmp", mt_file);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    if (write(fd, mt_buf, len) != (ssize_t)len || close(fd) ||
+        rename(tmp, mt_file))
+        unlink(tmp);
+}
+
+/*
+ * answer the pending connections on the metrics socket
+ */
+void
+metrics_accept(void)
+{
+    size_t  len;
+    ssize_t n;
+    int     fd;
+
+    while ((fd = accept4(mt_sock, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        len = metrics_snapshot();
+        /* fits in the socket buffer, a slow reader gets less */
+        n = write(fd, mt_buf, len);
+        (void)n;
+        close(fd);
+    }
+}
+
+/*
+ * msecs until the next window, for the event loop timeout
+ */
+int
+metrics_wait(void)
+{
+    double left = mt_next - mono_now();
+
+    return(left > 0 ? (int)(left * 1000) + 1 : 0);
+}
+
+/*
+ * called on every loop iteration, computes the rates once
+ * every window and rewrites the textfile
+ */
+void
+metrics_tick(void)
+{
+    double now = mono_now();
+    double dt;
+
+    if (now < mt_next)
+        return;
+    dt = now - mt_next + METRICS_EVERY;
+    mt_rate[0] = (metrics.started - mt_last.started) / dt;
+    mt_rate[1] = (metrics.bytes[0] - mt_last.bytes[0]) / dt;
+    mt_rate[2] = (metrics.bytes[1] - mt_last.bytes[1]) / dt;
+    mt_rate[3] = (metrics.lines[0] - mt_last.lines[0]) / dt;
+    mt_rate[4] = (metrics.lines[1] - mt_last.lines[1]) / dt;
+    mt_last = metrics;
+    mt_next = now + METRICS_EVERY;
+
+    if (mt_file)
+        metrics_write();
+}
+
+/*
+ * write the final textfile and remove the socket
+ */
+void
+metrics_close(void)
+{
+    if (mt_file)
+        metrics_write();
+    if (mt_sock >= 0) {
+        close(mt_sock);
+        unlink(mt_sockpath);
+        mt_sock = -1;
+    }
+}
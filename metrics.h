@@ -0,0 +1,55 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * live run metrics. the counters are bumped from the event
+ * loop as things happen, the rest is only worked out when a
+ * snapshot is taken: on a connection to the --metrics-sock
+ * unix socket, which gets the snapshot and is closed, and
+ * every METRICS_EVERY for the --metrics-file textfile. both
+ * are in the prometheus text format.
+ */
+#define METRICS_EVERY   1.0         /* rate window, textfile interval */
+#define METRICS_SLOW    5           /* slowest running hosts shown */
+#define METRICSBUF      8192
+
+struct
+metrics {
+    uint64_t    started;            /* spawn attempts */
+    uint64_t    ok;                 /* exit code 0 */
+    uint64_t    errors;             /* other exit codes */
+    uint64_t    sshfail;            /* ssh failures, exit code 255 */
+    uint64_t    timeouts;           /* killed by --timeout/--idle-timeout */
+    uint64_t    retries;            /* ssh failures queued for a retry */
+    uint64_t    bytes[2];           /* stdout, stderr */
+    uint64_t    lines[2];
+};
+
+extern struct metrics metrics;
+
+/* where the calling thread counts its bytes and lines */
+extern __thread struct metrics *thr_metrics;
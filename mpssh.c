@@ -27,7 +27,15 @@
 
 #include "mpssh.h"
 #include "host.h"
+#include "group.h"
+#include "timer.h"
 #include "pslot.h"
+#include "metrics.h"
+#include "retry.h"
+#include "tree.h"
+#include "out.h"
+#include "collect.h"
+#include "byhost.h"
 
 const char Ver[] = "1.4-dev";
 
@@ -42,179 +50,556 @@ char *label       = NULL;
 char *script      = NULL;
 char *base_script = NULL;
 char *ident_file  = NULL;
+char *pool_dir    = NULL;
+char *archive     = NULL;
+char *timing      = NULL;
+char *metrics_sock = NULL;
+char *metrics_file = NULL;
+char *extract     = NULL;
 
 int children       = 0;
 int maxchld        = 0;
 int blind          = 0;
+int fanout         = 0;
+int group_mode     = 0;
 int done           = 0;
 int delay          = 10;
 int hostcount      = 0;
 int pslots         = 0;
 int user_len_max   = 0;
 int host_len_max   = 0;
+int host_width     = 0;
+char *ssh_path     = SSHPATH;
 int print_exit     = 0;
 int local_command  = 0;
+int script_scp     = 0;
+int script_fd      = -1;
+char *interp       = NULL;
+int tree           = 0;
+int relay_mode     = 0;
+int collectors     = 0;
+int by_host        = 0;
+char *relay_cmd    = RELAYCMD;
 int ssh_hkey_check = 1;
 int ssh_quiet      = 0;
 int ssh_conn_tmout = 30;
+double sess_tmout  = 0;
+double idle_tmout  = 0;
+int retries        = 0;
+size_t max_line    = MAXLINE;
+double retry_delay = RETRY_DELAY;
 int verbose        = 0;
 int no_err         = 0;
 int no_out         = 0;
+int pool_mode      = POOL_OFF;
+int pool_ttl       = DEFPOOLTTL;
+int host_cache     = 1;
+int out_tty        = 0;
+int err_tty        = 0;
+int epfd           = -1;
+int sigfd          = -1;
 
 sigset_t sigmask;
 sigset_t osigmask;
 
 /* function declarations */
-struct host     *host_readlist(char *);
-void             host_free(struct host *);
+int              host_readlist(char *);
+struct host     *host_next(void);
+int              host_pending(void);
+void             host_watch(void);
+void             host_addarg(char *);
+void             host_free(void);
 struct procslot *pslot_add(struct procslot *, int, struct host *);
 struct procslot *pslot_del(struct procslot *);
-struct procslot *pslot_bypid(struct procslot *, int);
-void             pslot_printbuf(struct procslot *, int);
+struct procslot *pslot_bypid(int);
+void             pslot_setpid(struct procslot *, int);
+void             pslot_hashinit(int);
+void             pslot_poolinit(int);
+void             pslot_printbuf(struct procslot *, int, char *, size_t);
 int              pslot_readbuf(struct procslot *, int);
+void             pslot_flushbuf(struct procslot *, int);
+void             outbuf_flush(struct outbuf *);
+void             outbuf_init(void);
+void             archive_open(char *);
+int              archive_host(struct host *);
+void             archive_exit(int, int);
+void             archive_close(void);
+void             timing_open(char *);
+void             timing_host(struct procslot *);
+void             timing_close(void);
+void             metrics_init(char *, char *);
+void             metrics_accept(void);
+int              metrics_wait(void);
+void             metrics_tick(void);
+void             metrics_close(void);
+void             timer_init(void);
+void             timer_add(struct timer *, double);
+void             timer_del(struct timer *);
+int              timer_wait(void);
+void             timer_run(void);
+void             retry_init(double);
+double           retry_add(struct host *, int);
+struct host     *retry_next(int *);
+int              retry_pending(void);
+void             fanout_init(int);
+uint64_t         fanout_size(void);
+void             fanout_write(struct procslot *);
+char            *script_interp(int);
+char            *relay_cmdline(void);
+int              tree_init(int);
+struct host     *tree_next(void);
+void             tree_start(struct procslot *);
+void             tree_done(struct procslot *);
+int              archive_extract(char *, char *);
+void             group_start(struct procslot *);
+void             group_done(struct procslot *);
+void             group_drop(struct procslot *);
+void             group_print(void);
+void             pace_init(int);
+int              pace_take(void);
+int              pace_wait(void);
+void             pace_connected(double);
+void             pace_failed(void);
+void             collect_init(int, int);
+void             collect_add(struct procslot *);
+void             collect_finish(struct procslot *);
+int              collect_drain(void);
+void             collect_stop(void);
+void             session_done(struct procslot *);
+void             byhost_print(struct procslot *);
 
 /*
- * child reaping routine. it is installed as signal
- * hanler for the SIG_CHLD signal.
+ * monotonic clock in seconds
+ */
+double
+mono_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * a session timer fired. an expired session gets SIGTERM, and
+ * SIGKILL if it is still there KILLGRACE seconds later. the
+ * idle timer is not moved on every output, it checks the
+ * time of the last output when it fires instead.
+ */
+void
+session_timer(struct timer *t)
+{
+    struct procslot *p = t->arg;
+    double           idle;
+
+    /* the child is already reaped, kill(0) would hit our group */
+    if (p->pid <= 0)
+        return;
+
+    switch (t->type) {
+    case TM_IDLE:
+        idle = (tw_now - __atomic_load_n(&p->t_io, __ATOMIC_RELAXED)) *
+            TW_TICK / 1000.0;
+        if (idle < idle_tmout) {
+            timer_add(t, idle_tmout - idle);
+            return;
+        }
+        /* FALLTHROUGH */
+    case TM_TOTAL:
+        p->timedout = 1;
+        kill(p->pid, SIGTERM);
+        timer_del(&p->tm[0]);
+        timer_del(&p->tm[1]);
+        p->tm[0].type = TM_KILL;
+        timer_add(&p->tm[0], KILLGRACE);
+        break;
+    case TM_KILL:
+        kill(p->pid, SIGKILL);
+        break;
+    }
+}
+
+/*
+ * arm the timeouts of a freshly spawned session
+ */
+void
+session_start(struct procslot *p)
+{
+    p->t_io = tw_now;
+    p->tm[0].fn = p->tm[1].fn = session_timer;
+    p->tm[0].arg = p->tm[1].arg = p;
+    if (sess_tmout > 0) {
+        p->tm[0].type = TM_TOTAL;
+        timer_add(&p->tm[0], sess_tmout);
+    }
+    if (idle_tmout > 0) {
+        p->tm[1].type = TM_IDLE;
+        timer_add(&p->tm[1], idle_tmout);
+    }
+}
+
+/*
+ * child reaping routine. it is called from the event loop
+ * when the SIGCHLD signalfd becomes readable, so it is free
+ * to do stdio and touch the process slots.
  */
 void
 reap_child()
 {
     int pid;
     int ret;
+    struct signalfd_siginfo si[16];
+
+    /* drain the signalfd, waitpid() below finds all the children */
+    while (read(sigfd, si, sizeof(si)) > 0)
+        ;
 
     while ((pid = waitpid(-1, &ret, WNOHANG)) > 0) {
-        done++;
-        ps = pslot_bypid(ps, pid);
-        ps->pid = 0;
+        ps = pslot_bypid(pid);
+        if (ps == NULL)
+            continue;
+        pslot_setpid(ps, 0);
+        ps->t_exit = mono_now();
 
         if (WIFEXITED(ret))
             ps->ret = WEXITSTATUS(ret);
         else
             ps->ret = 255;
 
-        while (pslot_readbuf(ps, OUT))
-            pslot_printbuf(ps, OUT);
-        while (pslot_readbuf(ps, ERR))
-            pslot_printbuf(ps, ERR);
+        /* the hosts of a relay are counted from its frames */
+        if (ps->relay) {
+            pslot_readbuf(ps, OUT);
+            pslot_readbuf(ps, ERR);
+            pslot_flushbuf(ps, OUT);
+            pslot_flushbuf(ps, ERR);
+            tree_done(ps);
+            ps = pslot_del(ps);
+            children--;
+            continue;
+        }
+
+        /*
+         * an ssh level failure goes back to the queue, behind
+         * the fresh hosts, unless it is out of attempts.
+         * the pool control commands fail when there is no
+         * master, which is an answer, not a failure.
+         */
+        if (ps->ret == 255 && !ps->timedout && ps->attempt < retries &&
+            pool_mode != POOL_LIST && pool_mode != POOL_STOP) {
+            ps->retry_in = retry_add(ps->hst, ps->attempt + 1);
+            metrics.retries++;
+        } else
+            done++;
+
+        if (ps->retry_in > 0) {
+            /* counted when the last attempt ends */
+        } else if (ps->timedout) {
+            ps->ret = RET_TIMEOUT;
+            metrics.timeouts++;
+        } else if (ps->ret == 0)
+            metrics.ok++;
+        else if (ps->ret == 255)
+            metrics.sshfail++;
+        else
+            metrics.errors++;
+
+        if (archive)
+            archive_exit(ps->arc_id, ps->ret);
+
+        if (ps->ret == 255)
+            pace_failed();
+
+        /*
+         * the collector of the slot prints the rest of it,
+         * the child is gone, the timeouts must not fire
+         */
+        if (collectors) {
+            timer_del(&ps->tm[0]);
+            timer_del(&ps->tm[1]);
+            collect_finish(ps);
+            continue;
+        }
+
+        pslot_readbuf(ps, OUT);
+        pslot_readbuf(ps, ERR);
+        /* no newline will follow, print the partial lines */
+        pslot_flushbuf(ps, OUT);
+        pslot_flushbuf(ps, ERR);
+        if (group_mode && ps->retry_in > 0)
+            group_drop(ps);
+        else if (group_mode)
+            group_done(ps);
+        else if (by_host)
+            byhost_print(ps);
         /*
          * make sure that we print some output in verbose mode
          * even if there is no data in the buffer
          */
-        pslot_printbuf(ps, OUT);
-        ps = pslot_del(ps);
-        /* decrement this last, its used in pslot_bypid */
-        children--;
+        pslot_printbuf(ps, OUT, NULL, 0);
+        session_done(ps);
     }
     return;
 }
 
+/*
+ * the output of a reaped session is all printed, free its
+ * slot. with --collectors this is when its collector gives
+ * the slot back.
+ */
 void
-child()
+session_done(struct procslot *p)
 {
-    char *ssh_argv[19];
-    int   sap;
+    /* a timeout says nothing about the connect latency */
+    if (p->ret != 255 && !p->connected && !p->timedout)
+        pace_connected(mono_now() - p->t_spawn);
+
+    if (p->retry_in > 0) {
+        /* the retry queue owns the host now */
+        p->hst = NULL;
+    } else if (timing)
+        timing_host(p);
+    ps = pslot_del(p);
+    children--;
+}
 
-    char *lcmd;
-    int   len_u;
-    char *user_arg;
-    /* enough for -p65535\0 */
-    char  port_arg[8];
-    char  tmo_arg[32];
+/*
+ * ssh argv template. the arguments that are the same for
+ * every host are set up once by ssh_argv_init(), after the
+ * options are parsed, spawn_child() only appends the per
+ * host ones.
+ */
+static char *ssh_tmpl[MAXARGV];
+static int   ssh_tmpl_len;
+static char *ssh_remexec;
+static posix_spawnattr_t spawn_attr;
+
+void
+ssh_argv_init()
+{
+    int      sap;
+    int      len;
+    sigset_t cur;
+    sigset_t def;
+    static char tmo_arg[32];
+    static char ctl_path[PATH_MAX + 32];
+    static char ctl_persist[32];
 
-    ps->pid = 0;
     sap = 0;
 
-    /* close stdin of the child, so it won't accept input */
-    close(0);
+    ssh_tmpl[sap++] = ssh_path;
 
-    /* close the parent end of the pipes */
-    close(ps->io.out[0]);
-    close(ps->io.err[0]);
+    ssh_tmpl[sap++] = "-oNumberOfPasswordPrompts=0";
 
-    if (dup2(ps->io.out[1], 1) == -1)
-        perr("stdout dup fail %s\n",
-             strerror(errno));
+    if (ssh_quiet)
+        ssh_tmpl[sap++] = "-q";
 
-    if (dup2(ps->io.err[1], 2) == -1)
-        perr("stderr dup fail %s\n",
-             strerror(errno));
-#ifdef TESTING
-    ssh_argv[sap++] = "/bin/echo";
-#endif
+    if (ssh_hkey_check)
+        ssh_tmpl[sap++] = "-oStrictHostKeyChecking=yes";
+    else
+        ssh_tmpl[sap++] = "-oStrictHostKeyChecking=no";
 
-    ssh_argv[sap++] = SSHPATH;
+    snprintf(tmo_arg, sizeof(tmo_arg), "-oConnectTimeout=%d",
+            ssh_conn_tmout);
+    ssh_tmpl[sap++] = tmo_arg;
+
+    if (local_command && script_scp)
+        ssh_tmpl[sap++] = "-oPermitLocalCommand=yes";
+
+    if (pool_mode != POOL_OFF) {
+        snprintf(ctl_path, sizeof(ctl_path), "-oControlPath=%s/%%C",
+            pool_dir);
+        ssh_tmpl[sap++] = ctl_path;
+        switch (pool_mode) {
+        case POOL_LIST:
+            ssh_tmpl[sap++] = "-Ocheck";
+            break;
+        case POOL_STOP:
+            ssh_tmpl[sap++] = "-Oexit";
+            break;
+        default:
+            snprintf(ctl_persist, sizeof(ctl_persist),
+                "-oControlPersist=%d", pool_ttl);
+            ssh_tmpl[sap++] = "-oControlMaster=auto";
+            ssh_tmpl[sap++] = ctl_persist;
+            break;
+        }
+    }
 
-    ssh_argv[sap++] = "-oNumberOfPasswordPrompts=0";
+    if (ident_file) {
+        ssh_tmpl[sap++] = "-i";
+        ssh_tmpl[sap++] = ident_file;
+    }
 
-    if (ssh_quiet)
-        ssh_argv[sap++] = "-q";
+    ssh_tmpl_len = sap;
+
+    if (local_command && !script_scp) {
+        /* the interpreter reads the script from its stdin */
+        ssh_remexec = interp;
+    } else if (local_command) {
+        len = strlen(base_script) + 3;
+        ssh_remexec = calloc(1, len);
+        if (ssh_remexec == NULL) {
+            perr("%s\n", strerror(errno));
+            exit(1);
+        }
+        snprintf(ssh_remexec, len, "./%s", base_script);
+    } else if (pool_mode == POOL_WARM) {
+        /* the master stays up after this, for pool_ttl seconds */
+        ssh_remexec = "true";
+    } else if (pool_mode == POOL_LIST || pool_mode == POOL_STOP) {
+        /* control commands take no remote command */
+        ssh_remexec = NULL;
+    } else if (tree) {
+        ssh_remexec = relay_cmdline();
+    } else {
+        ssh_remexec = cmd;
+    }
 
-    /* space for -l and \0 */
-    len_u = strlen(ps->hst->user) + 3;
-    user_arg = calloc(1, len_u);
-    if (user_arg == NULL) {
-        exit(1);
+    /*
+     * children get the signal mask we were started with, and
+     * the default SIGPIPE, which the fan-out ignores in here
+     */
+    sigprocmask(SIG_SETMASK, NULL, &cur);
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_init(&spawn_attr);
+    posix_spawnattr_setsigmask(&spawn_attr, &cur);
+    posix_spawnattr_setsigdefault(&spawn_attr, &def);
+    posix_spawnattr_setflags(&spawn_attr,
+        POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+}
+
+/*
+ * quote a string for the remote shell
+ */
+static char *
+shquote(char *dst, const char *src)
+{
+    *dst++ = '\'';
+    for (; *src; src++) {
+        if (*src == '\'') {
+            memcpy(dst, "'\\''", 4);
+            dst += 4;
+        } else
+            *dst++ = *src;
     }
-    snprintf(user_arg, len_u, "-l%s", ps->hst->user);
-    ssh_argv[sap++] = user_arg;
+    *dst++ = '\'';
+    *dst = '\0';
+    return(dst);
+}
 
-    if (ps->hst->port != NON_DEFINED_PORT) {
-        snprintf(port_arg, sizeof(port_arg), "-p%d", ps->hst->port);
-        ssh_argv[sap++] = port_arg;
+/*
+ * the remote command of the tree mode relays: mpssh reading
+ * the hosts of its subtree from stdin, with our session
+ * options. the timeouts and retries are the relay's job,
+ * the relay sessions themselves have none of them.
+ */
+char *
+relay_cmdline(void)
+{
+    char   *buf;
+    char   *p;
+    size_t  len;
+
+    len = strlen(relay_cmd) + strlen(cmd) * 4 + 256;
+    buf = malloc(len);
+    if (buf == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
     }
+    p = buf + snprintf(buf, len,
+        "%s --relay -f - -p%d -d%d -t%d --max-line=%zu%s%s%s%s",
+        relay_cmd, maxchld, delay, ssh_conn_tmout, max_line,
+        ssh_hkey_check ? "" : " -s", ssh_quiet ? " -q" : "",
+        no_out ? " -O" : "", no_err ? " -E" : "");
+    if (sess_tmout > 0)
+        p += sprintf(p, " -T%g", sess_tmout);
+    if (idle_tmout > 0)
+        p += sprintf(p, " --idle-timeout=%g", idle_tmout);
+    if (retries > 0)
+        p += sprintf(p, " -R%d --retry-delay=%g", retries, retry_delay);
+    p += sprintf(p, " -- ");
+    shquote(p, cmd);
+
+    sess_tmout = idle_tmout = 0;
+    retries = 0;
+    return(buf);
+}
 
-    if (ssh_hkey_check)
-        ssh_argv[sap++] = "-oStrictHostKeyChecking=yes";
-    else
-        ssh_argv[sap++] = "-oStrictHostKeyChecking=no";
+/*
+ * start the ssh process for the host in the given slot.
+ * glibc's posix_spawn() uses clone(CLONE_VM|CLONE_VFORK),
+ * so the cost does not grow with our address space like
+ * fork() does. the per host strings can live on the stack,
+ * the parent is suspended until the child execs.
+ * returns the child's pid or -1 on failure.
+ */
+int
+spawn_child(struct procslot *p)
+{
+    char *ssh_argv[MAXARGV];
+    int   sap;
+    int   err;
+    pid_t pid;
+    posix_spawn_file_actions_t fa;
 
-    snprintf(tmo_arg,sizeof(tmo_arg), "-oConnectTimeout=%d",
-            ssh_conn_tmout);
-    ssh_argv[sap++] = tmo_arg;
+    char  user_arg[MAXNAME * 3 + 3];
+    /* enough for -p65535\0 */
+    char  port_arg[8];
+    char  scp_port_arg[8];
+    char  lcmd[2048];
 
+    memcpy(ssh_argv, ssh_tmpl, ssh_tmpl_len * sizeof(char *));
+    sap = ssh_tmpl_len;
 
-    if (local_command) {
-        snprintf(port_arg, sizeof(port_arg), "-P%d", (ps->hst->port
-            != NON_DEFINED_PORT ? ps->hst->port : DEFAULT_PORT));
-        ssh_argv[sap++] = "-oPermitLocalCommand=yes";
-        lcmd = calloc(1, 2048);
-        snprintf(lcmd, 2048, "-oLocalCommand=%s %s -p %s %s@%s:%s",
+    snprintf(user_arg, sizeof(user_arg), "-l%s", p->hst->user);
+    ssh_argv[sap++] = user_arg;
+
+    if (p->hst->port != NON_DEFINED_PORT) {
+        snprintf(port_arg, sizeof(port_arg), "-p%d", p->hst->port);
+        ssh_argv[sap++] = port_arg;
+    }
+
+    if (local_command && script_scp) {
+        snprintf(scp_port_arg, sizeof(scp_port_arg), "-P%d",
+            (p->hst->port != NON_DEFINED_PORT ? p->hst->port
+            : DEFAULT_PORT));
+        snprintf(lcmd, sizeof(lcmd), "-oLocalCommand=%s %s -p %s %s@%s:%s",
             SCPPATH,
-            port_arg,
+            scp_port_arg,
             script,
-            ps->hst->user,
-            ps->hst->host,
+            p->hst->user,
+            p->hst->host,
             base_script);
         ssh_argv[sap++] = lcmd;
     }
 
-    if (ident_file) {
-      ssh_argv[sap++] = "-i";
-      ssh_argv[sap++] = ident_file;
-    }
-
-    ssh_argv[sap++] = ps->hst->host;
+    ssh_argv[sap++] = p->hst->host;
+    if (ssh_remexec)
+        ssh_argv[sap++] = ssh_remexec;
+    ssh_argv[sap++] = NULL;
 
-    if (local_command) {
-        char *remexec;
-        remexec = calloc(1, strlen(base_script)+3);
-        snprintf(remexec, strlen(base_script)+3, "./%s", base_script);
-        ssh_argv[sap++] = remexec;
+    posix_spawn_file_actions_init(&fa);
+    if (fanout) {
+        /* the read end of the fanned out stdin */
+        posix_spawn_file_actions_adddup2(&fa, p->io.in[0], 0);
     } else {
-        ssh_argv[sap++] = cmd;
+        /* close stdin of the child, so it won't accept input */
+        posix_spawn_file_actions_addclose(&fa, 0);
     }
+    posix_spawn_file_actions_adddup2(&fa, p->io.out[1], 1);
+    posix_spawn_file_actions_adddup2(&fa, p->io.err[1], 2);
 
-    ssh_argv[sap++] = NULL;
+    err = posix_spawn(&pid, ssh_argv[0], &fa, &spawn_attr, ssh_argv, environ);
 
-#ifdef TESTING
-    execv("/bin/echo", ssh_argv);
-#else
-    execv(SSHPATH, ssh_argv);
-#endif
+    posix_spawn_file_actions_destroy(&fa);
 
-    perr("failed to exec the ssh binary");
-    exit(1);
+    if (err) {
+        perr("unable to spawn ssh for %s: %s\n",
+            p->hst->host, strerror(err));
+        return(-1);
+    }
+    return(pid);
 }
 
 /*
@@ -237,25 +622,76 @@ usage(char *msg)
     if (!msg) {
         printf("\n Usage: mpssh [-u username] [-p numprocs] [-f hostlist]\n"
         "              [-e] [-b] [-o /some/dir] [-s] [-v] <command>\n\n"
+        "  -a, --archive=FILE  save the remote output of all hosts in FILE\n"
         "  -b, --blind         enable blind mode (no remote output)\n"
-        "  -d, --delay         delay between each ssh fork (default %d msec)\n"
+        "      --by-host       print the output of each host in one block\n"
+        "                      when it is done\n"
+        "      --by-host-mem=MB  keep up to MB of --by-host output in\n"
+        "                      memory, the rest in temp files (default %d)\n"
+        "      --collectors=N  read and format the output in N threads,\n"
+        "                      for runs with a lot of output\n"
+        "  -d, --delay         initial delay between ssh spawns, adapted to\n"
+        "                      the connect latency and load (default %d msec,\n"
+        "                      0 disables pacing)\n"
         "  -e, --exit          print the remote command return code\n"
         "  -E, --no-err        suppress stderr output\n"
         "  -f, --file=FILE     file with the list of hosts or - for stdin\n"
+        "  -g, --group         print each distinct output once at the end,\n"
+        "                      with the list of hosts that produced it\n"
+        "  -X, --extract=FILE  print the output of [host] saved in archive FILE,\n"
+        "                      or list the archived hosts\n"
         "  -h, --help          this screen\n"
-        "  -l, --label=LABEL   connect only to hosts under label LABEL\n"
+        "  -H, --hosts=HOSTS   comma separated hosts to use instead of the\n"
+        "                      host list file, may be given more than once\n"
+        "      --host-width=N  pad the host names to N columns, by default\n"
+        "                      the longest name, or the longest so far when\n"
+        "                      the host list is streamed from a pipe\n"
+        "      --max-line=N    split the output lines longer than N bytes\n"
+        "                      (default %d)\n"
+        "  -l, --label=EXPR    connect only to hosts under these labels,\n"
+        "                      a list like app,-canary,&dc1\n"
+        "      --json          print JSON lines records, one per output\n"
+        "                      line and one per finished session\n"
         "  -i, --identity=FILE use the private key in FILE to connect to hosts\n"
+        "  -I, --stdin         send the local stdin to the command on every host\n"
+        "      --no-cache      do not use the compiled host list cache\n"
         "  -o, --outdir=DIR    save the remote output in this directory\n"
         "  -O, --no-out        suppress stdout output\n"
         "  -p, --procs=NPROC   number of parallel ssh processes (default %d)\n"
+        "  -P, --pool          reuse ssh connections from the connection pool\n"
+        "      --pool-dir=DIR  connection pool directory (default ~/%s)\n"
+        "      --pool-ttl=SEC  keep idle pooled connections for SEC seconds\n"
+        "                      (default %d)\n"
+        "      --pool-warm     open pooled connections to the hosts\n"
+        "      --pool-list     check the pooled connections to the hosts\n"
+        "      --pool-stop     close the pooled connections to the hosts\n"
         "  -q, --quiet         run ssh with -q\n"
-        "  -r, --script        copy local script to remote host and execute it\n"
+        "  -r, --script=FILE   run a local script on the hosts, streamed to\n"
+        "                      its #! interpreter over the ssh session\n"
+        "      --script-scp    copy the script with scp and run the copy,\n"
+        "                      the old -r, which takes two connections\n"
+        "      --tree=N        split the hosts in N subtrees and run them\n"
+        "                      from mpssh on the first host of each\n"
+        "      --relay-cmd=CMD mpssh command on the relays (default %s)\n"
+        "  -R, --retries=N     retry the hosts failing at the ssh level\n"
+        "                      up to N times\n"
+        "      --retry-delay=SEC  backoff before the first retry, doubled\n"
+        "                      on every attempt, with jitter (default %.0f)\n"
         "  -s, --nokeychk      disable ssh strict host key check\n"
+        "      --ssh=PATH      ssh binary to run (default %s)\n"
         "  -t, --conntmout     ssh connect timeout (default %d sec)\n"
+        "  -T, --timeout=SEC   kill the sessions running longer than SEC\n"
+        "      --idle-timeout=SEC  kill the sessions with no output for SEC\n"
+        "      --metrics-sock=PATH  serve live metrics on unix socket PATH\n"
+        "      --metrics-file=PATH  rewrite live metrics in PATH every second\n"
+        "      --timing=FILE   write the per host phase timing to FILE, as\n"
+        "                      csv or json (.json) and print percentiles\n"
         "  -u, --user=USER     ssh login as this username\n"
         "  -v, --verbose       be more verbose (i.e. show usernames used)\n"
         "  -V, --version       show program version\n"
-        "\n", delay, DEFCHLD, ssh_conn_tmout);
+        "\n", BYHOST_MEM, delay, MAXLINE, DEFCHLD, POOLDIR, DEFPOOLTTL, RELAYCMD,
+        RETRY_DELAY, SSHPATH,
+        ssh_conn_tmout);
     } else {
         printf("\n   *** %s\n\n", msg);
     }
@@ -270,20 +706,50 @@ parse_opts(int *argc, char ***argv)
     struct stat scstat;
 
     static struct option longopts[] = {
+        { "archive",   required_argument,  NULL,        'a' },
         { "blind",     no_argument,        NULL,        'b' },
         { "exit",      no_argument,        NULL,        'e' },
         { "file",      required_argument,  NULL,        'f' },
+        { "group",     no_argument,        NULL,        'g' },
+        { "extract",   required_argument,  NULL,        'X' },
         { "help",      no_argument,        NULL,        'h' },
+        { "hosts",     required_argument,  NULL,        'H' },
+        { "host-width", required_argument, NULL,        OPT_HOST_WIDTH },
+        { "ssh",       required_argument,  NULL,        OPT_SSH },
         { "identity",  required_argument,  NULL,        'i' },
+        { "stdin",     no_argument,        NULL,        'I' },
+        { "script-scp", no_argument,       NULL,        OPT_SCRIPT_SCP },
+        { "tree",      required_argument,  NULL,        OPT_TREE },
+        { "relay",     no_argument,        NULL,        OPT_RELAY },
+        { "relay-cmd", required_argument,  NULL,        OPT_RELAY_CMD },
+        { "max-line",  required_argument,  NULL,        OPT_MAX_LINE },
+        { "collectors", required_argument, NULL,        OPT_COLLECTORS },
+        { "by-host",   no_argument,        NULL,        OPT_BY_HOST },
+        { "by-host-mem", required_argument, NULL,       OPT_BY_HOST_MEM },
+        { "json",      no_argument,        NULL,        OPT_JSON },
         { "label",     required_argument,  NULL,        'l' },
+        { "no-cache",  no_argument,        NULL,        OPT_NO_CACHE },
         { "outdir",    required_argument,  NULL,        'o' },
         { "procs",     required_argument,  NULL,        'p' },
+        { "pool",      no_argument,        NULL,        'P' },
+        { "pool-dir",  required_argument,  NULL,        OPT_POOL_DIR },
+        { "pool-ttl",  required_argument,  NULL,        OPT_POOL_TTL },
+        { "pool-warm", no_argument,        NULL,        OPT_POOL_WARM },
+        { "pool-list", no_argument,        NULL,        OPT_POOL_LIST },
+        { "pool-stop", no_argument,        NULL,        OPT_POOL_STOP },
         { "quiet",     no_argument,        NULL,        'q' },
         { "script",    required_argument,  NULL,        'r' },
         { "nokeychk",  no_argument,        NULL,        's' },
         { "no-err",    no_argument,        NULL,        'E' },
         { "no-out",    no_argument,        NULL,        'O' },
         { "conntmout", required_argument,  NULL,        't' },
+        { "timeout",   required_argument,  NULL,        'T' },
+        { "idle-timeout", required_argument, NULL,      OPT_IDLE_TMOUT },
+        { "retries",   required_argument,  NULL,        'R' },
+        { "retry-delay", required_argument, NULL,       OPT_RETRY_DELAY },
+        { "timing",    required_argument,  NULL,        OPT_TIMING },
+        { "metrics-sock", required_argument, NULL,      OPT_METRICS_SOCK },
+        { "metrics-file", required_argument, NULL,      OPT_METRICS_FILE },
         { "user",      required_argument,  NULL,        'u' },
         { "verbose",   no_argument,        NULL,        'v' },
         { "version",   no_argument,        NULL,        'V' },
@@ -291,8 +757,13 @@ parse_opts(int *argc, char ***argv)
     };
 
     while ((opt = getopt_long(*argc, *argv,
-                "bd:eEf:hi:l:o:Op:qr:u:t:svV", longopts, NULL)) != -1) {
+                "a:bd:eEf:ghH:i:Il:o:Op:Pqr:R:u:t:T:svVX:", longopts, NULL)) != -1) {
         switch (opt) {
+            case 'a':
+                if (archive)
+                    usage("one archive allowed");
+                archive = optarg;
+                break;
             case 'b':
                 blind = 1;
                 break;
@@ -313,12 +784,21 @@ parse_opts(int *argc, char ***argv)
                     usage("one filename allowed");
                 fname = optarg;
                 break;
+            case 'g':
+                group_mode = 1;
+                break;
             case 'h':
                 usage(NULL);
                 break;
+            case 'H':
+                host_addarg(optarg);
+                break;
             case 'i':
                 ident_file = optarg;
                 break;
+            case 'I':
+                fanout = 1;
+                break;
             case 'l':
                 label = optarg;
                 break;
@@ -335,6 +815,46 @@ parse_opts(int *argc, char ***argv)
                 if (maxchld < 0) usage("bad numproc");
                 if (maxchld > MAXCHLD) maxchld = MAXCHLD;
                 break;
+            case 'P':
+                if (pool_mode == POOL_OFF)
+                    pool_mode = POOL_USE;
+                break;
+            case OPT_POOL_DIR:
+                pool_dir = optarg;
+                break;
+            case OPT_POOL_TTL:
+                pool_ttl = (int)strtol(optarg,(char **)NULL,10);
+                if (pool_ttl <= 0) usage("bad pool ttl");
+                break;
+            case OPT_POOL_WARM:
+                pool_mode = POOL_WARM;
+                break;
+            case OPT_POOL_LIST:
+                pool_mode = POOL_LIST;
+                break;
+            case OPT_POOL_STOP:
+                pool_mode = POOL_STOP;
+                break;
+            case OPT_NO_CACHE:
+                host_cache = 0;
+                break;
+            case OPT_METRICS_SOCK:
+                metrics_sock = optarg;
+                break;
+            case OPT_METRICS_FILE:
+                metrics_file = optarg;
+                break;
+            case OPT_TIMING:
+                timing = optarg;
+                break;
+            case OPT_SSH:
+                ssh_path = optarg;
+                break;
+            case OPT_HOST_WIDTH:
+                host_width = (int)strtol(optarg,(char **)NULL,10);
+                if (host_width <= 0 || host_width > MAXNAME)
+                    usage("bad host width");
+                break;
             case 'q':
                 ssh_quiet = 1;
                 break;
@@ -344,17 +864,66 @@ parse_opts(int *argc, char ***argv)
                 if (stat(script, &scstat) < 0) {
                     usage("can't stat script file");
                 }
-                if (!(S_ISREG(scstat.st_mode) && scstat.st_mode & 0111)) {
-                    usage("script file is not executable");
+                if (!S_ISREG(scstat.st_mode)) {
+                    usage("script is not a regular file");
                 }
                 base_script = basename(script);
                 break;
+            case OPT_SCRIPT_SCP:
+                script_scp = 1;
+                break;
+            case OPT_TREE:
+                tree = (int)strtol(optarg, NULL, 10);
+                if (tree <= 0) usage("bad number of subtrees");
+                break;
+            case OPT_RELAY:
+                relay_mode = 1;
+                break;
+            case OPT_RELAY_CMD:
+                relay_cmd = optarg;
+                break;
+            case OPT_MAX_LINE:
+                max_line = strtoul(optarg, NULL, 10);
+                if (max_line < 64) usage("bad max line length");
+                break;
+            case OPT_JSON:
+                json_mode = 1;
+                break;
+            case OPT_BY_HOST:
+                by_host = 1;
+                break;
+            case OPT_BY_HOST_MEM:
+                by_host_mem = strtoul(optarg, NULL, 10);
+                if (by_host_mem < 1) usage("bad by-host memory budget");
+                by_host_mem <<= 20;
+                break;
+            case OPT_COLLECTORS:
+                collectors = (int)strtol(optarg, NULL, 10);
+                if (collectors < 1 || collectors > MAXCOLLECT)
+                    usage("bad number of collectors");
+                break;
             case 's':
                 ssh_hkey_check = 0;
                 break;
             case 't':
                 ssh_conn_tmout = (int)strtol(optarg,(char **)NULL,10);
                 break;
+            case 'T':
+                sess_tmout = strtod(optarg, NULL);
+                if (sess_tmout <= 0) usage("bad timeout");
+                break;
+            case OPT_IDLE_TMOUT:
+                idle_tmout = strtod(optarg, NULL);
+                if (idle_tmout <= 0) usage("bad idle timeout");
+                break;
+            case 'R':
+                retries = (int)strtol(optarg, NULL, 10);
+                if (retries < 0) usage("bad number of retries");
+                break;
+            case OPT_RETRY_DELAY:
+                retry_delay = strtod(optarg, NULL);
+                if (retry_delay <= 0) usage("bad retry delay");
+                break;
             case 'u':
                 if (user)
                     usage("one username allowed");
@@ -368,6 +937,9 @@ parse_opts(int *argc, char ***argv)
             case 'V':
                 show_ver();
                 break;
+            case 'X':
+                extract = optarg;
+                break;
             case '?':
                 usage("unrecognized option");
                 break;
@@ -378,12 +950,62 @@ parse_opts(int *argc, char ***argv)
     *argc -= optind;
     *argv += optind;
 
+    /* the archive reader does not connect anywhere */
+    if (extract) {
+        if (*argc > 1)
+            usage("too many arguments");
+        exit(archive_extract(extract, *argc ? *argv[0] : NULL));
+    }
+
     if (!maxchld)
         maxchld = DEFCHLD;
 
+    if (fanout && fname && !strcmp(fname, "-"))
+        usage("stdin can't be both the host list and the input");
+
+    if (json_mode && (group_mode || by_host || tree || relay_mode))
+        usage("--json does not work with -g, --by-host, --tree or --relay");
+
+    if (by_host && (group_mode || blind || collectors || tree || relay_mode))
+        usage("--by-host does not work with -g, -b, --collectors, --tree "
+            "or --relay");
+
+    /* the collectors only keep the console output in order */
+    if (collectors && (archive || group_mode || tree || relay_mode))
+        usage("--collectors does not work with -a, -g, --tree or --relay");
+
+    if (tree) {
+        if (outdir || archive || group_mode || timing || fanout ||
+            local_command || pool_mode != POOL_OFF || relay_mode)
+            usage("--tree only works with a command and the console output");
+        /* the relays get their subtree on stdin */
+        fanout = 1;
+    }
+
     if (local_command) {
         if(*argc)
             usage("can't use remote command when executing local script");
+        if (script_scp) {
+            /* scp -p keeps the mode, the remote copy is run as is */
+            if (!(scstat.st_mode & 0111))
+                usage("script file is not executable");
+            return;
+        }
+        if (fanout)
+            usage("the stdin of a streamed script is the script");
+        script_fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0)
+            usage("can't open script file");
+        interp = script_interp(script_fd);
+        /* the script goes over the session's stdin */
+        fanout = 1;
+        return;
+    }
+
+    if (pool_mode == POOL_WARM || pool_mode == POOL_LIST ||
+        pool_mode == POOL_STOP) {
+        if (*argc)
+            usage("pool commands take no remote command");
         return;
     }
 
@@ -399,6 +1021,100 @@ parse_opts(int *argc, char ***argv)
     return;
 }
 
+/*
+ * the remote interpreter of a streamed script, from its #!
+ * line, or sh. started without a script argument, it reads
+ * the script from its stdin.
+ */
+char *
+script_interp(int fd)
+{
+    static char line[MAXCMD];
+    ssize_t n;
+    char   *p;
+    char   *e;
+
+    n = pread(fd, line, sizeof(line) - 1, 0);
+    if (n < 2 || line[0] != '#' || line[1] != '!')
+        return("sh");
+    line[n] = '\0';
+    if ((e = strchr(line, '\n')) == NULL)
+        usage("script #! line too long");
+    *e = '\0';
+    for (p = line + 2; *p == ' ' || *p == '\t'; p++)
+        ;
+    if (*p == '\0')
+        return("sh");
+    return(p);
+}
+
+/*
+ * create a directory and its missing parents, like mkdir -p
+ */
+int
+mkpath(char *path, mode_t mode)
+{
+    char *p;
+
+    for (p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(path, mode) && errno != EEXIST) {
+            *p = '/';
+            return(-1);
+        }
+        *p = '/';
+    }
+    if (mkdir(path, mode) && errno != EEXIST)
+        return(-1);
+    return(0);
+}
+
+/*
+ * find and create the connection pool directory.
+ * the control sockets in it are named by ssh after
+ * a hash of the local host, user, remote host and port,
+ * so there is one master per host entry.
+ */
+void
+setup_pooldir()
+{
+    char *home;
+    int   len;
+
+    if (!pool_dir) {
+        home = getenv("HOME");
+        if (!home) {
+            perr("Can't get HOME env var in %s\n", __func__);
+            exit(1);
+        }
+        len = strlen(home) + strlen("/"POOLDIR) + 1;
+        pool_dir = calloc(1, len);
+        if (!pool_dir) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+        snprintf(pool_dir, len, "%s/"POOLDIR, home);
+    }
+
+    /*
+     * the master binds to "dir/%C.XXXXXXXXXXXXXXXX" and renames
+     * it to "dir/%C" after, %C is 40 chars and the random suffix
+     * 17 with its dot. with the nul, the longer of the two must
+     * fit the 104 bytes of the smallest sun_path around.
+     */
+    if (strlen(pool_dir) + 1 + 40 + 17 + 1 > 104) {
+        perr("pool directory path too long: %s\n", pool_dir);
+        exit(1);
+    }
+
+    if (mkpath(pool_dir, 0700)) {
+        perr("can't create pool dir %s: %s\n", pool_dir, strerror(errno));
+        exit(1);
+    }
+}
+
 /*
  * Routine to handle stdout and stderr
  * output file creation and opening
@@ -451,67 +1167,189 @@ setupoutdirfiles(struct procslot *p)
     return(0);
 }
 
+/*
+ * Make sure that we have enough descriptors for the
+ * requested number of parallel sessions. Every child
+ * needs two pipes (and two more files with -o), so try
+ * to raise the soft limit up to the hard one and clamp
+ * maxchld to whatever we got.
+ */
+void
+setup_fdlimit()
+{
+    struct rlimit rl;
+    rlim_t need;
+    int    perchld;
+
+    perchld = (outdir ? 4 : 2) + fanout + by_host;
+    need = (rlim_t)maxchld * perchld + 16;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl))
+        return;
+    if (rl.rlim_cur >= need)
+        return;
+
+    rl.rlim_cur = (rl.rlim_max < need) ? rl.rlim_max : need;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+
+    if (rl.rlim_cur < need) {
+        maxchld = (rl.rlim_cur - 16) / perchld;
+        if (maxchld < 1)
+            maxchld = 1;
+        perr("  [*] descriptor limit too low, using %d parallel sessions\n",
+            maxchld);
+    }
+}
+
+/*
+ * the next host to spawn. the fresh hosts go first, the
+ * ones back from the retry queue after them.
+ */
+static struct host *
+next_host(int *attempt)
+{
+    struct host *hst;
+
+    if (tree) {
+        *attempt = 0;
+        return(tree_next());
+    }
+    if ((hst = host_next()) != NULL) {
+        *attempt = 0;
+        return(hst);
+    }
+    return(retry_next(attempt));
+}
+
 /*
  * Main routine
  */
 int
 main(int argc, char *argv[])
 {
-    struct host *hst, *tofree;
+    struct host *hst;
+    int    nhosts;
     int    i;
     int    pid;
     int    tty;
-    fd_set readfds;
-    int    children_fds;
-    struct timeval *timeout;
-    struct timeval  notimeout;
-    struct passwd  *pw;
+    int    nev;
+    int    reap;
+    int    drain;
+    int    timeout;
+    int    attempt;
+    struct evsrc       *src;
+    struct evsrc        sigsrc = { CHLD, NULL };
+    struct epoll_event  sigev;
+    struct epoll_event  events[MAXEVENTS];
+    struct passwd      *pw;
 
     parse_opts(&argc, &argv);
 
+    if (pool_mode != POOL_OFF)
+        setup_pooldir();
+
+    ssh_argv_init();
+
     if (!user) {
         pw = getpwuid(getuid());
         user = pw->pw_name;
     }
 
-    hst = host_readlist(fname);
-
-    if (hst == NULL) {
+    nhosts = host_readlist(fname);
+    if (nhosts == 0) {
         perr("host list file empty, "
             "does not exist or no valid entries\n");
         exit(1);
     }
+    if (tree && nhosts < 0) {
+        perr("--tree needs the whole host list, not a stream\n");
+        exit(1);
+    }
 
-    tofree = hst;
+    setup_fdlimit();
+
+    /* all of the input is in before the first session starts */
+    if (tree) {
+        maxchld = tree_init(tree);
+        signal(SIGPIPE, SIG_IGN);
+    } else if (fanout) {
+        fanout_init(script_fd >= 0 ? script_fd : 0);
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perr("unable to create epoll instance: %s\n", strerror(errno));
+        exit(1);
+    }
 
     /* Console Printf if we are running on tty */
-    tty = isatty(fileno(stdout));
+    tty = out_tty = isatty(fileno(stdout));
+    err_tty = isatty(fileno(stderr));
+    outbuf_init();
 #define tty_printf(...) if (tty) fprintf(stdout, __VA_ARGS__)
 
     tty_printf( "MPSSH - Mass Parallel Ssh Ver.%s\n"
-        "(c)2005-2013 Nikolay Denev <ndenev@gmail.com>\n\n"
-        "  [*] read (%d) hosts from the list\n",
-        Ver, hostcount);
+        "(c)2005-2013 Nikolay Denev <ndenev@gmail.com>\n\n", Ver);
 
-    if (local_command) {
+    if (nhosts < 0) {
+        tty_printf( "  [*] streaming hosts from stdin\n");
+    } else {
+        tty_printf( "  [*] read (%d) hosts from the list\n", hostcount);
+    }
+
+    if (pool_mode == POOL_WARM) {
+        tty_printf( "  [*] opening pooled connections as user \"%s\"\n", user);
+    } else if (pool_mode == POOL_LIST) {
+        tty_printf( "  [*] checking pooled connections\n");
+    } else if (pool_mode == POOL_STOP) {
+        tty_printf( "  [*] closing pooled connections\n");
+    } else if (local_command && script_scp) {
         tty_printf( "  [*] uploading and executing the script \"%s\" as user \"%s\"\n",
             script, user);
+    } else if (local_command) {
+        tty_printf( "  [*] streaming the script \"%s\" to \"%s\" as user \"%s\"\n",
+            script, interp, user);
     } else {
         tty_printf( "  [*] executing \"%s\" as user \"%s\"\n", cmd, user);
     }
 
+    if (tree)
+        tty_printf("  [*] relaying through %d subtrees with \"%s\"\n",
+            maxchld, relay_cmd);
+
+    if (fanout && !local_command && !tree)
+        tty_printf("  [*] sending %llu bytes of stdin to every host\n",
+            (unsigned long long)fanout_size());
+
     if (label)
         tty_printf("  [*] only on hosts labeled \"%s\"\n", label);
 
+    if (pool_mode != POOL_OFF)
+        tty_printf("  [*] using connection pool : %s\n", pool_dir);
+
     if (!ssh_hkey_check)
         tty_printf("  [*] strict host key check disabled\n");
 
     if (blind)
         tty_printf("  [*] blind mode enabled\n");
 
+    if (group_mode)
+        tty_printf("  [*] grouping identical output\n");
+
     if (verbose)
         tty_printf("  [*] verbose mode enabled\n");
 
+    if (by_host)
+        tty_printf("  [*] printing the output by host\n");
+
+    if (collectors)
+        tty_printf("  [*] collecting the output in %d threads\n", collectors);
+
+    if (archive)
+        tty_printf("  [*] saving the output in archive : %s\n", archive);
+
     if (outdir) {
         if (!access(outdir, R_OK | W_OK | X_OK)) {
            tty_printf("  [*] using output directory : %s\n", outdir);
@@ -528,79 +1366,186 @@ main(int argc, char *argv[])
             maxchld);
     fflush(NULL);
 
-    /* install the signal handler for SIGCHLD */
-    signal(SIGCHLD, reap_child);
+    /*
+     * SIGCHLD stays blocked and is read from a signalfd
+     * registered in the event loop, so the children are
+     * reaped synchronously between the output events.
+     */
+    BLOCK_SIGCHLD;
+    sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0) {
+        perr("unable to create signalfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    sigev.events = EPOLLIN;
+    sigev.data.ptr = &sigsrc;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &sigev)) {
+        perr("unable to register signalfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    pslot_hashinit(maxchld);
+    pslot_poolinit(maxchld);
+
+    if (collectors)
+        collect_init(collectors, maxchld);
 
     if (outdir)
         umask(022);
 
-    while (hst || children) {
-        BLOCK_SIGCHLD;
-        if (hst && (children < maxchld)) {
+    if (archive)
+        archive_open(archive);
+
+    if (timing)
+        timing_open(timing);
+
+    if (metrics_sock || metrics_file)
+        metrics_init(metrics_sock, metrics_file);
+
+    pace_init(delay);
+
+    timer_init();
+
+    if (retries)
+        retry_init(retry_delay);
+
+    host_watch();
+
+    hst = next_host(&attempt);
+    while (hst || children || host_pending() || retry_pending()) {
+        /*
+         * a streamed host list may have more hosts by now,
+         * or a retry may be due
+         */
+        if (!hst && children < maxchld)
+            hst = next_host(&attempt);
+
+        /*
+         * spawn as many sessions as the pacer allows, but
+         * come back to drain the output every few spawns
+         */
+        for (i = 0; i < SPAWNBATCH && hst && (children < maxchld)
+            && pace_take(); i++) {
             ps = pslot_add(ps, 0, hst);
+            ps->attempt = attempt;
+            if (tree)
+                tree_start(ps);
             if (outdir)
                 setupoutdirfiles(ps);
-            switch (pid = fork()) {
-            case 0:
-                /* child, does not return */
-                child();
-                break;
-            case -1:
-                /* error */
-                perr("unable to fork: %s\n",
-                    strerror(errno));
-                break;
-            default:
-                /* parent */
-                ps->pid = pid;
-                /* close the child's end of the pipes */
-                close(ps->io.out[1]);
-                close(ps->io.err[1]);
+            if (archive)
+                ps->arc_id = archive_host(ps->hst);
+            if (group_mode)
+                group_start(ps);
+            ps->t_spawn = mono_now();
+            metrics.started++;
+            pid = spawn_child(ps);
+            /* close the child's end of the pipes */
+            close(ps->io.out[1]);
+            close(ps->io.err[1]);
+            if (fanout) {
+                close(ps->io.in[0]);
+                ps->io.in[0] = -1;
+            }
+            if (pid < 0) {
+                ps = pslot_del(ps);
+            } else {
+                pslot_setpid(ps, pid);
                 children++;
-                break;
+                session_start(ps);
+                if (collectors)
+                    collect_add(ps);
             }
-            /* delay between each sshd fork */
-            if (delay)
-                usleep(delay * 1000);
 
-            hst = hst->next;
+            hst = next_host(&attempt);
         }
-        FD_ZERO(&readfds);
-        children_fds = children;
-        for (i=0; i <= children_fds; i++) {
-            FD_SET(ps->io.out[0], &readfds);
-            FD_SET(ps->io.err[0], &readfds);
-            if (ps->next)
-                ps = ps->next;
-        }
-        if (children == maxchld || !hst) {
-            timeout = NULL;
-        } else {
-            memset(&notimeout, 0, sizeof(struct timeval));
-            timeout = &notimeout;
+        /* sleep until there is output, or the next spawn is due */
+        if (children == maxchld || !hst)
+            timeout = -1;
+        else
+            timeout = pace_wait();
+
+        /* wake up for the next timer tick */
+        i = timer_wait();
+        if (i >= 0 && (timeout < 0 || i < timeout))
+            timeout = i;
+
+        /* wake up for the next metrics window */
+        if (metrics_sock || metrics_file) {
+            i = metrics_wait();
+            if (timeout < 0 || i < timeout)
+                timeout = i;
         }
-        UNBLOCK_SIGCHLD;
-        if (select(MAXFD , &readfds, NULL, NULL, timeout) > 0 ) {
-            BLOCK_SIGCHLD;
-            if (ps) {
-                for (i=0; i <= children_fds; i++) {
-                    if (FD_ISSET(ps->io.out[0], &readfds)) {
-                        while (pslot_readbuf(ps, OUT))
-                            pslot_printbuf(ps, OUT);
-                    }
-                    if (FD_ISSET(ps->io.err[0], &readfds)) {
-                        while (pslot_readbuf(ps, ERR))
-                            pslot_printbuf(ps, ERR);
-                    }
-                    ps = ps->next;
-                }
+
+        /* the loop goes idle, write out the batched output */
+        outbuf_flush(&ob_out);
+        outbuf_flush(&ob_err);
+
+        nev = epoll_wait(epfd, events, MAXEVENTS, timeout);
+
+        /* only the slots with pending data are visited */
+        reap = drain = 0;
+        for (i = 0; i < nev; i++) {
+            src = events[i].data.ptr;
+            if (src->type == CHLD) {
+                reap = 1;
+                continue;
+            }
+            if (src->type == COLLECT) {
+                drain = 1;
+                continue;
+            }
+            if (src->type == HOSTS)
+                continue;
+            if (src->type == METRICS) {
+                metrics_accept();
+                continue;
+            }
+            if (src->type == IN) {
+                fanout_write(src->ps);
+                continue;
             }
-            UNBLOCK_SIGCHLD;
+            pslot_readbuf(src->ps, src->type);
         }
+
+        /*
+         * reap and drain the collectors after the output
+         * events, both free slots that later events in this
+         * batch may point to
+         */
+        if (reap)
+            reap_child();
+        if (drain)
+            collect_drain();
+
+        timer_run();
+
+        if (metrics_sock || metrics_file)
+            metrics_tick();
+    }
+    if (collectors)
+        collect_stop();
+    outbuf_flush(&ob_out);
+    outbuf_flush(&ob_err);
+
+    if (archive)
+        archive_close();
+
+    if (timing)
+        timing_close();
+
+    if (metrics_sock || metrics_file)
+        metrics_close();
+
+    if (group_mode)
+        group_print();
+
+    if (metrics.retries) {
+        tty_printf("\n  Done. %d hosts processed, %llu retries.\n", done,
+            (unsigned long long)metrics.retries);
+    } else {
+        tty_printf("\n  Done. %d hosts processed.\n", done);
     }
-    tty_printf("\n  Done. %d hosts processed.\n", done);
 
-    host_free(tofree);
+    host_free();
 
     return(0);
 }
@@ -29,11 +29,16 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <getopt.h>
+#include <spawn.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <time.h>
@@ -41,6 +46,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
 
 #ifndef SSHPATH
 #define SSHPATH    "/usr/bin/ssh"
@@ -52,13 +59,23 @@
 
 /* Default hosts filename, relative to users homedir */
 #define HSTLIST  ".mpssh/hosts"
+/* Default connection pool dir, relative to users homedir */
+#define POOLDIR  ".mpssh/pool"
+#define DEFPOOLTTL 600               /* idle pooled connection lifetime */
 #define MAXCMD   1024                /* max command len */
 #define MAXUSER    30                /* max username len */
-#define MAXCHLD  1024                /* max child procs */
+#define MAXARGV    24                /* max ssh argv entries */
+#define MAXCHLD  8192                /* max child procs */
 #define DEFCHLD   100                /* default child procs */
+#define SPAWNBATCH 32                /* max spawns per loop iteration */
 #define OUT         1
 #define ERR         2
-#define MAXFD    1024                /* max filedesc number */
+#define CHLD        3                /* SIGCHLD event source */
+#define HOSTS       4                /* streamed host list */
+#define METRICS     5                /* metrics socket */
+#define IN          6                /* stdin fan-out pipe */
+#define COLLECT     7                /* collector thread wakeups */
+#define MAXEVENTS 256                /* epoll events per wakeup */
 
 /* block/unblck SIGCHLD macros. */
 #define BLOCK_SIGCHLD                           \
@@ -69,21 +86,89 @@
 #define UNBLOCK_SIGCHLD                         \
     sigprocmask(SIG_SETMASK, &osigmask, NULL)
 
+/* connection pool modes */
+#define POOL_OFF    0
+#define POOL_USE    1                /* run commands over pooled masters */
+#define POOL_WARM   2                /* only open the masters */
+#define POOL_LIST   3                /* ssh -O check */
+#define POOL_STOP   4                /* ssh -O exit */
+
+/* long only options */
+#define OPT_POOL_DIR   256
+#define OPT_POOL_TTL   257
+#define OPT_POOL_WARM  258
+#define OPT_POOL_LIST  259
+#define OPT_POOL_STOP  260
+#define OPT_NO_CACHE   261
+#define OPT_HOST_WIDTH 262
+#define OPT_SSH        263
+#define OPT_TIMING     264
+#define OPT_METRICS_SOCK 265
+#define OPT_METRICS_FILE 266
+#define OPT_IDLE_TMOUT 267
+#define OPT_RETRY_DELAY 268
+#define OPT_SCRIPT_SCP 269
+#define OPT_TREE       270
+#define OPT_RELAY      271
+#define OPT_RELAY_CMD  272
+#define OPT_MAX_LINE   273
+#define OPT_COLLECTORS 274
+#define OPT_BY_HOST    275
+#define OPT_BY_HOST_MEM 276
+#define OPT_JSON       277
+
+/* session timeouts */
+#define TM_TOTAL    0
+#define TM_IDLE     1
+#define TM_KILL     2                /* SIGKILL after KILLGRACE */
+#define KILLGRACE   5                /* sec between SIGTERM and SIGKILL */
+#define RET_TIMEOUT 124              /* exit code of timed out sessions */
+#define RET_NOEXIT  125              /* archived host that never exited */
+
 #define perr(...) fprintf(stderr, __VA_ARGS__)
 
+/*
+ * event source, stored in the epoll_event data pointer
+ * of every descriptor registered in the event loop.
+ * type is OUT or ERR for the process slot pipes,
+ * CHLD for the SIGCHLD signalfd, HOSTS for the
+ * streamed host list, METRICS for the metrics
+ * socket, IN for the stdin fan-out pipes and COLLECT
+ * for the collector thread wakeups.
+ */
+struct
+evsrc {
+    int     type;
+    struct  procslot *ps;
+};
+
 /* some global vars */
+extern char **environ;
 extern int maxchld;
 extern const char Rev[];
 extern int user_len_max;
 extern int host_len_max;
+extern int host_width;
 extern int children;
 extern int verbose;
+extern int host_cache;
 extern int done;
 extern int print_exit;
+extern int retries;
 extern int hostcount;
 extern int blind;
+extern int fanout;
+extern int relay_mode;
+extern int collectors;
+extern int by_host;
+extern int json_mode;
+extern int group_mode;
 extern char *outdir;
+extern char *archive;
 extern char *user;
 extern char *label;
 extern int no_err;
 extern int no_out;
+extern int out_tty;
+extern int err_tty;
+extern int epfd;
@@ -0,0 +1,164 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <poll.h>
+
+#include "mpssh.h"
+#include "out.h"
+
+void   collect_batch(struct outbuf *);
+void   collect_line(struct outbuf *, const char *, size_t, const char *, size_t);
+
+static char ob_out_buf[OUTBUF];
+static char ob_err_buf[OUTBUF];
+
+struct outbuf ob_out = { 1, 0, ob_out_buf, NULL };
+struct outbuf ob_err = { 2, 0, ob_err_buf, NULL };
+
+__thread struct outbuf *thr_out = &ob_out;
+__thread struct outbuf *thr_err = &ob_err;
+
+int out_shared = 0;
+
+/*
+ * when stdout and stderr are the same tty or file, the
+ * stderr lines go in the stdout batch, so the two keep
+ * the order the lines came in
+ */
+void
+outbuf_init(void)
+{
+    struct stat so;
+    struct stat se;
+
+    if (fstat(1, &so) || fstat(2, &se))
+        return;
+    if (so.st_dev == se.st_dev && so.st_ino == se.st_ino) {
+        out_shared = 1;
+        thr_err = &ob_out;
+    }
+}
+
+/*
+ * write the whole iovec array, restarting after short
+ * writes. if the descriptor is non-blocking, wait for it.
+ */
+void
+outbuf_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+    struct pollfd pfd;
+
+    while (iovcnt) {
+        n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            /* nothing sensible left to do, drop the data */
+            return;
+        }
+        while (iovcnt && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/*
+ * append one line, prefix + line + newline. if it does
+ * not fit, the batch and the line go out together in a
+ * single writev() without copying the line.
+ */
+void
+outbuf_line(struct outbuf *ob, const char *pfx, size_t pfxlen,
+    const char *line, size_t len)
+{
+    struct iovec iov[4];
+
+    if (ob->len + pfxlen + len + 1 <= OUTBUF) {
+        memcpy(ob->buf + ob->len, pfx, pfxlen);
+        ob->len += pfxlen;
+        memcpy(ob->buf + ob->len, line, len);
+        ob->len += len;
+        ob->buf[ob->len++] = '\n';
+        return;
+    }
+
+    if (ob->coll) {
+        /* the line goes in the next batch, or in one of its own */
+        collect_batch(ob);
+        if (pfxlen + len + 1 <= OUTBUF)
+            outbuf_line(ob, pfx, pfxlen, line, len);
+        else
+            collect_line(ob, pfx, pfxlen, line, len);
+        return;
+    }
+
+    iov[0].iov_base = ob->buf;
+    iov[0].iov_len = ob->len;
+    iov[1].iov_base = (void *)pfx;
+    iov[1].iov_len = pfxlen;
+    iov[2].iov_base = (void *)line;
+    iov[2].iov_len = len;
+    iov[3].iov_base = "\n";
+    iov[3].iov_len = 1;
+    outbuf_writev(ob->fd, iov, 4);
+    ob->len = 0;
+}
+
+/*
+ * write out the pending batch
+ */
+void
+outbuf_flush(struct outbuf *ob)
+{
+    struct iovec iov;
+
+    if (!ob->len)
+        return;
+    if (ob->coll) {
+        collect_batch(ob);
+        return;
+    }
+    iov.iov_base = ob->buf;
+    iov.iov_len = ob->len;
+    outbuf_writev(ob->fd, &iov, 1);
+    ob->len = 0;
+}
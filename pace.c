@@ -0,0 +1,174 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mpssh.h"
+#include "pace.h"
+
+double mono_now(void);
+
+static int    pacing   = 0;
+static double rate     = 0;     /* current spawns per second */
+static double tokens   = 0;
+static double last     = 0;     /* last token refill */
+static double best_lat = 0;     /* best connect latency seen */
+static double next_chk = 0;     /* next load average check */
+static double ncpu     = 1;
+
+/*
+ * set up the pacer, the initial rate comes from the
+ * -d delay in msec. zero delay disables pacing.
+ */
+void
+pace_init(int delay_ms)
+{
+    long n;
+
+    if (delay_ms <= 0)
+        return;
+
+    pacing = 1;
+    rate = 1000.0 / delay_ms;
+    if (rate < PACE_MINRATE)
+        rate = PACE_MINRATE;
+    if (rate > PACE_MAXRATE)
+        rate = PACE_MAXRATE;
+    tokens = 1;
+    last = next_chk = mono_now();
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+        ncpu = n;
+}
+
+static void
+pace_setrate(double r)
+{
+    if (r < PACE_MINRATE)
+        r = PACE_MINRATE;
+    if (r > PACE_MAXRATE)
+        r = PACE_MAXRATE;
+    rate = r;
+}
+
+/*
+ * add the tokens accumulated since the last call and
+ * back off once per check interval if the local load
+ * average is above the number of cpus
+ */
+static void
+pace_refill(void)
+{
+    double now;
+    double burst;
+    double load;
+
+    now = mono_now();
+    tokens += (now - last) * rate;
+    last = now;
+
+    burst = rate * PACE_BURST;
+    if (burst < 1)
+        burst = 1;
+    if (tokens > burst)
+        tokens = burst;
+
+    if (now >= next_chk) {
+        next_chk = now + PACE_CHECK;
+        if (getloadavg(&load, 1) == 1 && load > ncpu)
+            pace_setrate(rate * PACE_SLOWDOWN);
+    }
+}
+
+/*
+ * take a token for one spawn, returns 0 if we have to wait
+ */
+int
+pace_take(void)
+{
+    if (!pacing)
+        return(1);
+
+    pace_refill();
+    if (tokens < 1)
+        return(0);
+    tokens -= 1;
+    return(1);
+}
+
+/*
+ * msec until the next token is available, used as
+ * the event loop timeout instead of sleeping
+ */
+int
+pace_wait(void)
+{
+    double ms;
+
+    if (!pacing)
+        return(0);
+
+    pace_refill();
+    if (tokens >= 1)
+        return(0);
+    ms = (1 - tokens) / rate * 1000.0;
+    return((int)ms + 1);
+}
+
+/*
+ * a session produced its first output (or exited) after
+ * lat seconds. compare against the best latency seen so
+ * far, speed up if it is close and slow down if not.
+ */
+void
+pace_connected(double lat)
+{
+    if (!pacing)
+        return;
+
+    /* the best latency slowly forgets a lucky sample */
+    if (best_lat == 0 || lat < best_lat)
+        best_lat = lat;
+    else
+        best_lat += (lat - best_lat) * 0.01;
+
+    if (lat > best_lat * PACE_SLOW)
+        pace_setrate(rate * PACE_SLOWDOWN);
+    else
+        pace_setrate(rate + rate * PACE_INCR);
+}
+
+/*
+ * the ssh session failed (exit code 255)
+ */
+void
+pace_failed(void)
+{
+    if (!pacing)
+        return;
+
+    pace_setrate(rate * PACE_BACKOFF);
+}
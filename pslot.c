@@ -26,8 +26,164 @@
  */
 
 #include "mpssh.h"
+#include "group.h"
+#include "timer.h"
 #include "pslot.h"
+#include "metrics.h"
 #include "host.h"
+#include "out.h"
+
+void   outbuf_line(struct outbuf *, const char *, size_t, const char *, size_t);
+void   archive_line(int, int, const char *, size_t);
+void   group_line(struct procslot *, int, const char *, size_t);
+void   pslot_printbuf(struct procslot *, int, char *, size_t);
+void   pace_connected(double);
+void   host_put(struct host *);
+void   timer_del(struct timer *);
+void   fanout_open(struct procslot *);
+void   tree_line(struct procslot *, const char *, size_t);
+void   collect_connected(struct procslot *);
+void   byhost_line(struct procslot *, const char *, size_t, const char *, size_t);
+void   byhost_free(struct procslot *);
+void   json_prefix(struct procslot *);
+void   json_line(struct outbuf *, struct procslot *, int, const char *, size_t);
+void   json_exit(struct outbuf *, struct procslot *);
+double mono_now(void);
+
+/*
+ * add a pipe read end to the event loop
+ */
+static int
+pslot_watch(int fd, struct evsrc *src)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = src;
+    return(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+char *pfx_out[] = { "OUT:", "->", "\033[1;32m->\033[0;39m", NULL };
+char *pfx_err[] = { "ERR:", "=>", "\033[1;31m=>\033[0;39m", NULL };
+char *pfx_ret[] = { "=:", "\033[1;32m=:\033[0;39m", "\033[1;31m=:\033[0;39m", NULL };
+char *pfx_crt[] = { "!!!", "\033[1;33m!!!\033[0;39m", NULL };
+
+/*
+ * lead + the host part of the prefixes + tail at dst, which
+ * is in the same buffer, after the host part
+ */
+static size_t
+pslot_pfxcpy(char *dst, const char *lead, const char *host, size_t hlen,
+    const char *tail)
+{
+    size_t llen = strlen(lead);
+    size_t tlen = strlen(tail);
+
+    memcpy(dst, lead, llen);
+    memcpy(dst + llen, host, hlen);
+    memcpy(dst + llen + hlen, tail, tlen + 1);
+    return(llen + hlen + tlen);
+}
+
+/*
+ * render the output prefixes of a slot once, when it is
+ * created: pfx[0] is the padded host (and user in verbose
+ * mode), pfx[OUT] and pfx[ERR] add the stream marker,
+ * colored if the stream is a terminal.
+ */
+static void
+pslot_mkprefix(struct procslot *pslot)
+{
+    int    hlen;
+    int    olen;
+    int    elen;
+    char  *buf;
+    char   tail[32];
+
+    /* a relay prints frames instead, see tree.h */
+    if (relay_mode) {
+        hlen = strlen(pslot->hst->user) + strlen(pslot->hst->host) + 1;
+        buf = malloc(hlen * 3 + 9);
+        if (buf == NULL) {
+            perr("%s\n", strerror(errno));
+            exit(1);
+        }
+        sprintf(buf, "%s\t%s", pslot->hst->user, pslot->hst->host);
+        pslot->pfx[0] = buf;
+        pslot->pfxlen[0] = hlen;
+        pslot->pfx[OUT] = buf + hlen + 1;
+        pslot->pfxlen[OUT] = pslot_pfxcpy(pslot->pfx[OUT], "O\t",
+            buf, hlen, "\t");
+        pslot->pfx[ERR] = pslot->pfx[OUT] + pslot->pfxlen[OUT] + 1;
+        pslot->pfxlen[ERR] = pslot_pfxcpy(pslot->pfx[ERR], "E\t",
+            buf, hlen, "\t");
+        return;
+    }
+
+    /* the heads of the --json records */
+    if (json_mode) {
+        json_prefix(pslot);
+        return;
+    }
+
+    if (verbose)
+        hlen = snprintf(NULL, 0, "%*s@%*s",
+            user_len_max, pslot->hst->user,
+            host_len_max, pslot->hst->host);
+    else
+        hlen = snprintf(NULL, 0, "%*s",
+            host_len_max, pslot->hst->host);
+    olen = hlen + strlen(pfx_out[out_tty + 1]) + 2;
+    elen = hlen + strlen(pfx_err[err_tty + 1]) + 2;
+
+    buf = malloc(hlen + olen + elen + 3);
+    if (buf == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (verbose)
+        snprintf(buf, hlen + 1, "%*s@%*s",
+            user_len_max, pslot->hst->user,
+            host_len_max, pslot->hst->host);
+    else
+        snprintf(buf, hlen + 1, "%*s",
+            host_len_max, pslot->hst->host);
+    pslot->pfx[0] = buf;
+    pslot->pfxlen[0] = hlen;
+
+    pslot->pfx[OUT] = buf + hlen + 1;
+    snprintf(tail, sizeof(tail), " %s ", pfx_out[out_tty + 1]);
+    pslot->pfxlen[OUT] = pslot_pfxcpy(pslot->pfx[OUT], "", buf, hlen, tail);
+
+    pslot->pfx[ERR] = pslot->pfx[OUT] + olen + 1;
+    snprintf(tail, sizeof(tail), " %s ", pfx_err[err_tty + 1]);
+    pslot->pfxlen[ERR] = pslot_pfxcpy(pslot->pfx[ERR], "", buf, hlen, tail);
+}
+
+/*
+ * the process slots come from a pool, allocated at once
+ * for maxchld slots. the pool only grows if more slots
+ * than that are ever in use at the same time.
+ */
+static struct procslot *pool_free = NULL;
+
+void
+pslot_poolinit(int nslots)
+{
+    struct procslot *slab;
+    int    i;
+
+    slab = calloc(nslots, sizeof(struct procslot));
+    if (slab == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+    for (i = nslots - 1; i >= 0; i--) {
+        slab[i].next = pool_free;
+        pool_free = &slab[i];
+    }
+}
 
 /*
  * process slot initialization routine
@@ -36,12 +192,24 @@ static struct procslot*
 pslot_new(int pid, struct host *hst)
 {
     struct procslot *pslot_tmp;
+    struct linebuf   lb[2];
 
-    pslot_tmp = calloc(1, sizeof(struct procslot));
-    if (pslot_tmp == NULL) {
-        perr("%s\n", strerror(errno));
-        exit(1);
+    if ((pslot_tmp = pool_free) != NULL) {
+        pool_free = pslot_tmp->next;
+    } else {
+        pslot_tmp = calloc(1, sizeof(struct procslot));
+        if (pslot_tmp == NULL) {
+            perr("%s\n", strerror(errno));
+            exit(1);
+        }
     }
+    /* a slot from the pool keeps its line buffers */
+    memcpy(lb, pslot_tmp->lb, sizeof(lb));
+    memset(pslot_tmp, 0, sizeof(struct procslot));
+    memcpy(pslot_tmp->lb, lb, sizeof(lb));
+    pslot_tmp->lb[0].len = 0;
+    pslot_tmp->lb[1].len = 0;
+
     pslot_tmp->pid = pid;
     pslot_tmp->hst = hst;
     pslot_tmp->outf[0].name    = NULL;
@@ -49,10 +217,41 @@ pslot_new(int pid, struct host *hst)
     pslot_tmp->outf[1].name    = NULL;
     pslot_tmp->outf[1].fh    = NULL;
     pslot_tmp->used = 0;
-    pipe(pslot_tmp->io.out);
-    pipe(pslot_tmp->io.err);
+    pslot_mkprefix(pslot_tmp);
+    /*
+     * close-on-exec keeps the other children from inheriting
+     * our ends of the pipes, dup2() in the child clears it
+     * for the descriptors it really needs.
+     */
+    if (pipe2(pslot_tmp->io.out, O_CLOEXEC) ||
+        pipe2(pslot_tmp->io.err, O_CLOEXEC)) {
+        perr("unable to create pipe: %s\n", strerror(errno));
+        exit(1);
+    }
     fcntl(pslot_tmp->io.out[0], F_SETFL, O_NONBLOCK);
     fcntl(pslot_tmp->io.err[0], F_SETFL, O_NONBLOCK);
+
+    /*
+     * register the read ends once, edge triggered. with
+     * collectors the one that gets the slot does it.
+     */
+    pslot_tmp->ev[0].type = OUT;
+    pslot_tmp->ev[0].ps = pslot_tmp;
+    pslot_tmp->ev[1].type = ERR;
+    pslot_tmp->ev[1].ps = pslot_tmp;
+    if (!collectors &&
+        (pslot_watch(pslot_tmp->io.out[0], &pslot_tmp->ev[0]) ||
+        pslot_watch(pslot_tmp->io.err[0], &pslot_tmp->ev[1]))) {
+        perr("unable to register pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (fanout) {
+        fanout_open(pslot_tmp);
+    } else {
+        pslot_tmp->io.in[0] = -1;
+        pslot_tmp->io.in[1] = -1;
+    }
     return(pslot_tmp);
 }
 
@@ -85,14 +284,15 @@ pslot_add(struct procslot *pslot, int pid, struct host *hst)
 
 /*
  * routine for deleting process slot from the ring list
- * it adjusts the links of the neighbor pslots and free()'s
- * the slot, closing it's piped descriptors
+ * it adjusts the links of the neighbor pslots and returns
+ * the slot to the pool, closing it's piped descriptors
  */
 struct procslot*
 pslot_del(struct procslot *pslot)
 {
     struct procslot *pslot_todel;
     int    is_last = 0;
+    int    i;
 
     if (!pslot) return(NULL);
 
@@ -104,8 +304,15 @@ pslot_del(struct procslot *pslot)
     pslot->prev->next = pslot_todel->next;
     pslot->next->prev = pslot_todel->prev;
     pslot = pslot_todel->next;
+    /*
+     * the pipes are close-on-exec and the children are spawned
+     * with vfork semantics, so nobody else holds a copy and the
+     * close() removes them from the epoll set as well
+     */
     close(pslot_todel->io.out[0]);
     close(pslot_todel->io.err[0]);
+    if (pslot_todel->io.in[1] >= 0)
+        close(pslot_todel->io.in[1]);
 
     /*
      * close the stdout and stderr filehandles,
@@ -125,7 +332,22 @@ pslot_del(struct procslot *pslot)
         free(pslot_todel->outf[1].name);
     }
 
-    free(pslot_todel);
+    free(pslot_todel->pfx[0]);
+    timer_del(&pslot_todel->tm[0]);
+    timer_del(&pslot_todel->tm[1]);
+    host_put(pslot_todel->hst);
+    free(pslot_todel->relay);
+    byhost_free(pslot_todel);
+    /* don't let one long line hold memory for the rest of the run */
+    for (i = 0; i < 2; i++) {
+        if (pslot_todel->lb[i].cap > LINEBUF_KEEP) {
+            free(pslot_todel->lb[i].buf);
+            pslot_todel->lb[i].buf = NULL;
+            pslot_todel->lb[i].cap = 0;
+        }
+    }
+    pslot_todel->next = pool_free;
+    pool_free = pslot_todel;
 
     if (is_last) {
         pslots++;
@@ -137,172 +359,347 @@ pslot_del(struct procslot *pslot)
 }
 
 /*
- * routine used by the child reaper routine installed as
- * signal handler for SIGCHLD.
- * it iterates thru the process slots and finds the slot
- * with the pid that we have supplied as argument.
+ * pid -> process slot hash table, used by the child
+ * reaper to find the slot of an exited child in O(1).
+ * pids are handed out sequentially, so the low bits
+ * spread well enough without further hashing.
+ */
+static struct procslot **pidhash = NULL;
+static unsigned int      pidhash_mask = 0;
+
+void
+pslot_hashinit(int nslots)
+{
+    unsigned int size;
+
+    for (size = 64; size < (unsigned int)nslots * 2; size <<= 1)
+        ;
+    pidhash = calloc(size, sizeof(struct procslot *));
+    if (pidhash == NULL) {
+        perr("%s\n", strerror(errno));
+        exit(1);
+    }
+    pidhash_mask = size - 1;
+}
+
+/*
+ * set the pid of a process slot, keeping the hash table
+ * in sync. pid 0 removes the slot from the table.
+ */
+void
+pslot_setpid(struct procslot *pslot, int pid)
+{
+    struct procslot **pp;
+
+    if (pslot->pid) {
+        pp = &pidhash[pslot->pid & pidhash_mask];
+        while (*pp && *pp != pslot)
+            pp = &(*pp)->hnext;
+        if (*pp)
+            *pp = pslot->hnext;
+        pslot->hnext = NULL;
+    }
+    pslot->pid = pid;
+    if (pid) {
+        pp = &pidhash[pid & pidhash_mask];
+        pslot->hnext = *pp;
+        *pp = pslot;
+    }
+}
+
+/*
+ * routine used by the child reaper routine.
+ * it finds the slot with the pid that we have
+ * supplied as argument.
  */
 struct procslot*
-pslot_bypid(struct procslot *pslot, int pid)
+pslot_bypid(int pid)
 {
-    int i;
+    struct procslot *pslot;
 
-    for (i=0; i <= children; i++) {
+    for (pslot = pidhash[pid & pidhash_mask]; pslot; pslot = pslot->hnext)
         if (pslot->pid == pid)
             return(pslot);
-        pslot = pslot->next;
-    }
     return(NULL);
 }
 
+/*
+ * read buffer, one full read from the pipe, per thread
+ */
+static __thread char rdbuf[RDBUF];
+
+/*
+ * add to the slot's carried partial line. the buffer grows
+ * as needed, up to max_line. a line longer than that is
+ * printed in max_line pieces.
+ */
+static void
+pslot_carry(struct procslot *pslot, int outfd, const char *p, size_t n)
+{
+    struct linebuf *lb;
+    size_t  take;
+    size_t  cap;
+
+    lb = &pslot->lb[outfd - 1];
+    while (n) {
+        if (lb->len == max_line) {
+            pslot_printbuf(pslot, outfd, lb->buf, lb->len);
+            lb->len = 0;
+        }
+        take = max_line - lb->len;
+        if (take > n)
+            take = n;
+        if (lb->len + take > lb->cap) {
+            cap = lb->cap ? lb->cap : LINEBUF_MIN;
+            while (cap < lb->len + take)
+                cap *= 2;
+            if (cap > max_line)
+                cap = max_line;
+            lb->buf = realloc(lb->buf, cap);
+            if (lb->buf == NULL) {
+                perr("%s\n", strerror(errno));
+                exit(1);
+            }
+            lb->cap = cap;
+        }
+        memcpy(lb->buf + lb->len, p, take);
+        lb->len += take;
+        p += take;
+        n -= take;
+    }
+}
+
+/*
+ * read everything that is available on the slot's stdout or
+ * stderr pipe, using large reads into the shared buffer.
+ * complete lines are handed to pslot_printbuf() in place,
+ * the trailing partial line is carried over in the slot's
+ * line buffer until the rest of it arrives.
+ * returns 1 if the pipe is drained for now, 0 on EOF or error.
+ */
 int
 pslot_readbuf(struct procslot *pslot, int outfd)
 {
-    int   i;
-    int   fd;
-    char  buf;
-    char *bufp;
+    int     fd;
+    ssize_t n;
+    char   *p;
+    char   *nl;
+    char   *end;
+    struct  linebuf *lb;
 
     switch (outfd) {
         case OUT:
             fd = pslot->io.out[0];
-            bufp = pslot->out_buf;
             break;
         case ERR:
             fd = pslot->io.err[0];
-            bufp = pslot->err_buf;
             break;
         default:
             return 0;
     }
+    lb = &pslot->lb[outfd - 1];
 
     for (;;) {
-        i = read(fd, &buf, sizeof(buf));
-        if (i == 0) return 0;
-        if (i < 0) {
+        n = read(fd, rdbuf, RDBUF);
+        if (n == 0) return 0;
+        if (n < 0) {
             if (errno == EINTR) continue;
-            return 0;
+            return (errno == EAGAIN);
         }
-        if (buf == '\n') return 1;
-        strncat(bufp, &buf, 1);
-        if (strlen(bufp) >= (LINEBUF-1)) return 1;
+        thr_metrics->bytes[outfd - 1] += n;
+        /* the lines of one read share the --json timestamp */
+        if (json_mode)
+            pslot->t_read = mono_now();
+        /* read by the idle timer, maybe in another thread */
+        __atomic_store_n(&pslot->t_io,
+            __atomic_load_n(&tw_now, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+        /* the first output tells the pacer how fast we connect */
+        if (!pslot->connected) {
+            pslot->connected = 1;
+            pslot->t_first = mono_now();
+            if (collectors)
+                collect_connected(pslot);
+            else
+                pace_connected(pslot->t_first - pslot->t_spawn);
+        }
+
+        p = rdbuf;
+        end = rdbuf + n;
+        /* finish the carried line first */
+        if (lb->len) {
+            nl = memchr(p, '\n', n);
+            pslot_carry(pslot, outfd, p, (nl ? nl : end) - p);
+            if (nl) {
+                pslot_printbuf(pslot, outfd, lb->buf, lb->len);
+                lb->len = 0;
+                p = nl + 1;
+            } else
+                p = end;
+        }
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            /* split the lines longer than max_line */
+            while ((size_t)(nl - p) > max_line) {
+                pslot_printbuf(pslot, outfd, p, max_line);
+                p += max_line;
+            }
+            /* empty lines are not printed */
+            if (nl > p)
+                pslot_printbuf(pslot, outfd, p, nl - p);
+            p = nl + 1;
+        }
+        if (end > p)
+            pslot_carry(pslot, outfd, p, end - p);
+
+        /*
+         * a short read from a pipe means that it is empty,
+         * new data will trigger a new edge, so don't spend
+         * a syscall just to get EAGAIN.
+         */
+        if (n < RDBUF)
+            return 1;
     }
+}
+
+/*
+ * print the partial line left in the slot's line buffer,
+ * used when the child is gone and no newline will follow
+ */
+void
+pslot_flushbuf(struct procslot *pslot, int outfd)
+{
+    struct linebuf *lb;
 
+    lb = &pslot->lb[outfd - 1];
+    if (lb->len) {
+        pslot_printbuf(pslot, outfd, lb->buf, lb->len);
+        lb->len = 0;
+    }
 }
 
+/*
+ * print one line of output from the slot, to the output
+ * files with -o and to the console batches. called with
+ * no data when the child is gone, to print its status.
+ */
 void
-pslot_printbuf(struct procslot *pslot, int outfd)
+pslot_printbuf(struct procslot *pslot, int outfd, char *bufp, size_t len)
 {
-    char  *bufp;
-    FILE  *stream;
-    char   progress[9];
-    char **stream_pfx;
-    char  *pfx_out[] = { "OUT:", "->", "\033[1;32m->\033[0;39m", NULL };
-    char  *pfx_err[] = { "ERR:", "=>", "\033[1;31m=>\033[0;39m", NULL };
-    char  *pfx_ret[] = { "=:", "\033[1;32m=:\033[0;39m", "\033[1;31m=:\033[0;39m", NULL };
-    char  *pfx_crt[] = { "!!!", "\033[1;33m!!!\033[0;39m", NULL };
+    struct outbuf *ob;
+    FILE  *fh;
+    char   line[MAXNAME * 8];
+    int    n;
+
+    /* every line counts, printed or not */
+    if (len)
+        thr_metrics->lines[outfd - 1]++;
+
+    /* the frames of a relay, with the output of its hosts */
+    if (len && pslot->relay && outfd == OUT) {
+        tree_line(pslot, bufp, len);
+        return;
+    }
 
     switch (outfd) {
     case OUT:
-                if (no_out)
-                    return;
-        bufp = pslot->out_buf;
-        stream_pfx = pfx_out;
-        stream = stdout;
+        if (no_out)
+            return;
+        ob = thr_out;
         break;
     case ERR:
-                if (no_err)
-                    return;
-        bufp = pslot->err_buf;
-        stream_pfx = pfx_err;
-        stream = stderr;
+        if (no_err)
+            return;
+        /* a relay keeps the frames of both in order, so do the records */
+        ob = (relay_mode || json_mode) ? thr_out : thr_err;
         break;
     default:
         return;
     }
 
-    /*
-    if (verbose) {
-        //snprintf(progress, sizeof(progress), "[%d]", 100 / ( hostcount - done ) );
-        progress[0] = '\0';
-    } else {
-        progress[0] = '\0';
-    }
-    */
-    progress[0] = '\0';
-
-    if (strlen(bufp)) {
+    if (len) {
         if (outdir) {
-            /* print to file */
-            fprintf(pslot->outf[outfd - 1].fh, "%s\n", bufp);
-            fflush(pslot->outf[outfd - 1].fh);
+            /* print to file, stdio does the buffering */
+            fh = pslot->outf[outfd - 1].fh;
+            fwrite(bufp, 1, len, fh);
+            putc('\n', fh);
+            pslot->used++;
+        }
+        if (archive) {
+            archive_line(pslot->arc_id, outfd, bufp, len);
             pslot->used++;
         }
-        if (!blind) {
+        if (group_mode) {
+            /* printed once per distinct output at the end */
+            group_line(pslot, outfd, bufp, len);
+            pslot->used++;
+        } else if (by_host) {
+            /* printed in one block when the child is reaped */
+            byhost_line(pslot, pslot->pfx[outfd], pslot->pfxlen[outfd],
+                bufp, len);
+            pslot->used++;
+        } else if (relay_mode && !blind) {
+            /* the frame header carries the length, see tree.h */
+            n = snprintf(line, sizeof(line), "%s%zu\t",
+                pslot->pfx[outfd], len);
+            outbuf_line(ob, line, n, bufp, len);
+            pslot->used++;
+        } else if (json_mode && !blind) {
+            json_line(ob, pslot, outfd, bufp, len);
+            pslot->used++;
+        } else if (!blind) {
             /* print to console */
-            if (verbose) {
-                fprintf(stream, "%*s@%*s %s%s %s\n",
-                    user_len_max, pslot->hst->user,
-                    host_len_max, pslot->hst->host,
-                    progress,
-                    stream_pfx[isatty(fileno(stream))+1],
-                    bufp);
-            } else {
-                fprintf(stream, "%*s %s %s\n",
-                    host_len_max, pslot->hst->host,
-                    stream_pfx[isatty(fileno(stream))+1],
-                    bufp);
-            }
-            fflush(stream);
+            outbuf_line(ob, pslot->pfx[outfd], pslot->pfxlen[outfd],
+                bufp, len);
             pslot->used++;
         }
-        memset(bufp, 0, LINEBUF);
+        return;
+    }
+
     /*
      * the child is dead and we are going to print exit code if reqested
      * so, make sure that we print it only when we are called for OUT fd,
      * because we want it printed only once
      */
-    } else if (!pslot->pid && (outfd == OUT)) {
-        if (pslot->ret == 255) {
-            if (verbose) {
-                printf("%*s@%*s %s ssh failure\n",
-                    user_len_max, pslot->hst->user,
-                    host_len_max, pslot->hst->host,
-                    pfx_crt[isatty(fileno(stdout))]);
-            } else {
-                printf("%*s %s ssh failure\n",
-                    host_len_max, pslot->hst->host,
-                    pfx_crt[isatty(fileno(stdout))]);
-            }
-            fflush(stdout);
-            return;
-        }
-        if (print_exit) {
-            /*
-             * print exit code prefix "=:", bw if we are not on a tty, 
-             * green if return code is zero and red if differs from zero
-             * pfx_ret[isatty(fileno(stdout))?(pslot->ret?2:1):0]
-             */
-            if (verbose) {
-                printf("%*s@%*s %s%s %d\n",
-                    user_len_max, pslot->hst->user,
-                    host_len_max, pslot->hst->host,
-                    progress,
-                    pfx_ret[isatty(fileno(stdout))?(pslot->ret?2:1):0],
-                    pslot->ret);
-            } else {
-                printf("%*s %s %d\n",
-                    host_len_max, pslot->hst->host,
-                    pfx_ret[isatty(fileno(stdout))?(pslot->ret?2:1):0],
-                    pslot->ret);
-            }
-            fflush(stdout);
-        } else if (!pslot->used && !blind && verbose) {
-            printf("%*s@%*s %s\n",
-                user_len_max, pslot->hst->user,
-                host_len_max, pslot->hst->host,
-                progress);
-        }
+    if (pslot->pid || (outfd != OUT) || group_mode)
+        return;
+
+    /* every session ends with a record */
+    if (json_mode) {
+        json_exit(thr_out, pslot);
+        return;
     }
 
+    if (relay_mode) {
+        /* every host is reported, unless it is going to be retried */
+        if (pslot->retry_in > 0)
+            return;
+        n = snprintf(line, sizeof(line), "%c\t%s\t%d",
+            pslot->timedout ? 'T' : 'X', pslot->pfx[0], pslot->ret);
+    } else if (pslot->timedout) {
+        n = snprintf(line, sizeof(line), "%s %s timeout",
+            pslot->pfx[0], pfx_crt[out_tty]);
+    } else if (pslot->ret == 255 && pslot->retry_in > 0) {
+        n = snprintf(line, sizeof(line), "%s %s ssh failure, retry %d/%d in %.1fs",
+            pslot->pfx[0], pfx_crt[out_tty], pslot->attempt + 1,
+            retries, pslot->retry_in);
+    } else if (pslot->ret == 255) {
+        n = snprintf(line, sizeof(line), "%s %s ssh failure",
+            pslot->pfx[0], pfx_crt[out_tty]);
+    } else if (print_exit) {
+        /*
+         * print exit code prefix "=:", bw if we are not on a tty,
+         * green if return code is zero and red if differs from zero
+         */
+        n = snprintf(line, sizeof(line), "%s %s %d",
+            pslot->pfx[0],
+            pfx_ret[out_tty ? (pslot->ret ? 2 : 1) : 0],
+            pslot->ret);
+    } else if (!pslot->used && !blind && verbose) {
+        n = snprintf(line, sizeof(line), "%s ", pslot->pfx[0]);
+    } else {
+        return;
+    }
+    if (n >= (int)sizeof(line))
+        n = sizeof(line) - 1;
+    outbuf_line(thr_out, line, n, "", 0);
 }
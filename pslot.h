@@ -25,16 +25,32 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#define LINEBUF 1024    /* max output line len */
+#define RDBUF   65536   /* bytes requested per read() */
+#define LINEBUF_MIN  256        /* first partial line buffer */
+#define LINEBUF_KEEP 65536      /* bigger ones are freed with the slot */
+#define MAXLINE  1048576        /* default --max-line */
 
 
-/* stdout/err structure for struct procslot */
+/* stdin/out/err structure for struct procslot */
 struct
 stdio_pipe {
+    int in[2];                  /* -1 unless the stdin is fanned out */
     int out[2];
     int err[2];
 };
 
+/*
+ * partial line carried over between reads, the buffer
+ * grows as needed up to --max-line and stays with the
+ * slot when it goes back to the pool
+ */
+struct
+linebuf {
+    char   *buf;
+    size_t  len;
+    size_t  cap;
+};
+
 /* stdout/stderr output filenames and filehandles */
 struct
 out_files {
@@ -47,14 +63,34 @@ struct
 procslot {
     int     pid;
     struct  host *hst;
-    char    out_buf[LINEBUF];
-    char    err_buf[LINEBUF];
+    struct  linebuf lb[2];
+    char   *pfx[3];             /* host, OUT and ERR line prefixes */
+    size_t  pfxlen[3];
     struct  out_files outf[2];
     int     used;
     int     ret;
+    int     arc_id;             /* host id in the --archive index */
+    struct  grpstate grp;       /* --group output matching */
+    int     connected;          /* first output or exit seen */
+    double  t_spawn;
+    double  t_first;            /* first output byte */
+    double  t_exit;             /* reaped */
+    double  t_read;             /* last read, for --json */
+    struct  timer tm[2];        /* total and idle timeouts */
+    uint64_t t_io;              /* tick of the last output */
+    int     timedout;
+    int     attempt;            /* retries before this session */
+    double  retry_in;           /* backoff before the next one, or 0 */
     struct  stdio_pipe io;
+    uint64_t in_off;            /* stdin fan-out position */
+    uint64_t in_end;
+    struct  relay *relay;       /* tree mode relay session */
+    struct  collector *coll;    /* --collectors shard */
+    struct  hostbuf *hb;        /* --by-host output */
+    struct  evsrc ev[3];
     struct  procslot *prev;
     struct  procslot *next;
+    struct  procslot *hnext;    /* pid hash chain */
 };
 
 /* global process slot var */
@@ -62,3 +98,10 @@ extern struct procslot *ps;
 
 /* other global vars */
 extern int pslots;
+extern size_t max_line;
+
+/* stream, exit code and ssh failure markers, plain and colored */
+extern char *pfx_out[];
+extern char *pfx_err[];
+extern char *pfx_ret[];
+extern char *pfx_crt[];
@@ -0,0 +1,139 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "mpssh.h"
+#include "host.h"
+#include "timer.h"
+#include "retry.h"
+
+void   timer_add(struct timer *, double);
+
+static double        base_delay = RETRY_DELAY;
+static struct retry *rt_ready = NULL;   /* backoff over, in order */
+static struct retry *rt_tail = NULL;
+static int           rt_count = 0;      /* waiting or ready */
+
+/*
+ * set up the retry queue, delay is the backoff before
+ * the first retry, it doubles with every attempt
+ */
+void
+retry_init(double delay)
+{
+    base_delay = delay;
+    srandom(getpid() ^ time(NULL));
+}
+
+/*
+ * the backoff of a host is over, queue it for spawning
+ */
+static void
+retry_due(struct timer *t)
+{
+    struct retry *r = t->arg;
+
+    r->next = NULL;
+    if (rt_tail)
+        rt_tail->next = r;
+    else
+        rt_ready = r;
+    rt_tail = r;
+}
+
+/*
+ * queue a host for its next attempt. the backoff doubles with
+ * every attempt, up to RETRY_MAXDELAY, and half of it is random
+ * so the hosts that failed together do not come back together.
+ * returns the backoff in seconds.
+ */
+double
+retry_add(struct host *hst, int attempt)
+{
+    struct retry *r;
+    double        d;
+
+    r = calloc(1, sizeof(struct retry));
+    if (r == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    r->hst = hst;
+    r->attempt = attempt;
+
+    d = base_delay;
+    while (--attempt > 0 && d < RETRY_MAXDELAY)
+        d *= 2;
+    if (d > RETRY_MAXDELAY)
+        d = RETRY_MAXDELAY;
+    d = d / 2 + d / 2 * random() / RAND_MAX;
+
+    r->tm.fn = retry_due;
+    r->tm.arg = r;
+    timer_add(&r->tm, d);
+    rt_count++;
+    return(d);
+}
+
+/*
+ * the next host whose backoff is over, or NULL.
+ * attempt is set to the number of the attempt.
+ */
+struct host *
+retry_next(int *attempt)
+{
+    struct retry *r;
+    struct host  *hst;
+
+    if ((r = rt_ready) == NULL)
+        return(NULL);
+    rt_ready = r->next;
+    if (rt_ready == NULL)
+        rt_tail = NULL;
+    rt_count--;
+
+    hst = r->hst;
+    *attempt = r->attempt;
+    free(r);
+    return(hst);
+}
+
+/*
+ * are there hosts waiting for a retry
+ */
+int
+retry_pending(void)
+{
+    return(rt_count);
+}
@@ -0,0 +1,183 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mpssh.h"
+#include "timer.h"
+
+uint64_t            tw_now = 0;
+
+static struct timer *tw_wheel[TW_LEVELS][TW_SIZE];
+static double        tw_base;
+static int           tw_count = 0;
+
+double mono_now(void);
+
+void
+timer_init(void)
+{
+    tw_base = mono_now();
+    tw_now = 0;
+}
+
+static uint64_t
+timer_tick(void)
+{
+    return((uint64_t)((mono_now() - tw_base) * 1000 / TW_TICK));
+}
+
+/*
+ * put the timer in the slot for its distance from now
+ */
+static void
+timer_link(struct timer *t)
+{
+    struct timer **slot;
+    uint64_t       d;
+    int            lvl;
+
+    /* due now when cascaded, the current slot runs next */
+    if (t->expires < tw_now)
+        t->expires = tw_now;
+    d = t->expires - tw_now;
+    if (d >> (TW_BITS * TW_LEVELS)) {
+        t->expires = tw_now + ((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1;
+        d = t->expires - tw_now;
+    }
+    for (lvl = 0; d >> (TW_BITS * (lvl + 1)); lvl++)
+        ;
+    slot = &tw_wheel[lvl][(t->expires >> (TW_BITS * lvl)) & TW_MASK];
+
+    t->next = *slot;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+void
+timer_del(struct timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    tw_count--;
+}
+
+/*
+ * arm the timer to fire in secs, rearming it if needed
+ */
+void
+timer_add(struct timer *t, double secs)
+{
+    timer_del(t);
+    t->expires = tw_now + (uint64_t)(secs * 1000 / TW_TICK + 0.999);
+    if (t->expires == tw_now)
+        t->expires++;
+    timer_link(t);
+    tw_count++;
+}
+
+/*
+ * move the timers of a higher level slot down, now that
+ * they are within reach of the lower levels
+ */
+static int
+timer_cascade(int lvl)
+{
+    struct timer *t;
+    struct timer *next;
+    int           idx;
+
+    idx = (tw_now >> (TW_BITS * lvl)) & TW_MASK;
+    t = tw_wheel[lvl][idx];
+    tw_wheel[lvl][idx] = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        timer_link(t);
+    }
+    return(idx);
+}
+
+/*
+ * msecs until the next tick that has something to do, for
+ * the event loop timeout, or -1 with no timers armed. that
+ * is the next occupied slot of level 0, or the end of its
+ * turn, when the higher levels cascade.
+ */
+int
+timer_wait(void)
+{
+    uint64_t next;
+    double   left;
+    int      k;
+
+    if (tw_count == 0)
+        return(-1);
+    next = (tw_now | TW_MASK) + 1;
+    for (k = 1; k < TW_SIZE && tw_now + k < next; k++)
+        if (tw_wheel[0][(tw_now + k) & TW_MASK]) {
+            next = tw_now + k;
+            break;
+        }
+    left = tw_base + next * TW_TICK / 1000.0 - mono_now();
+    return(left > 0 ? (int)(left * 1000) + 1 : 0);
+}
+
+/*
+ * advance the wheel to the current time and fire the timers
+ * that expired, a timer can be rearmed from its callback
+ */
+void
+timer_run(void)
+{
+    struct timer *t;
+    uint64_t      target;
+    int           lvl;
+
+    /* the collector threads read tw_now, store it atomically */
+    target = timer_tick();
+    while (tw_now < target) {
+        /* nothing to fire, jump ahead */
+        if (tw_count == 0) {
+            __atomic_store_n(&tw_now, target, __ATOMIC_RELAXED);
+            break;
+        }
+        __atomic_store_n(&tw_now, tw_now + 1, __ATOMIC_RELAXED);
+        for (lvl = 1; lvl < TW_LEVELS &&
+            ((tw_now >> (TW_BITS * (lvl - 1))) & TW_MASK) == 0; lvl++)
+            if (timer_cascade(lvl))
+                break;
+
+        while ((t = tw_wheel[0][tw_now & TW_MASK]) != NULL) {
+            timer_del(t);
+            t->fn(t);
+        }
+    }
+}
@@ -0,0 +1,195 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "mpssh.h"
+#include "host.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+#include "timing.h"
+
+static FILE             *tim_fh = NULL;
+static int               tim_json;
+static int               tim_nrec;
+static double            tim_start;
+static struct tim_phase  tim_phase[TIM_PHASES];
+static const char       *tim_name[TIM_PHASES] = {
+    "first byte", "exit", "drain", "total"
+};
+
+double mono_now(void);
+
+void
+timing_open(char *fname)
+{
+    size_t len = strlen(fname);
+
+    tim_fh = fopen(fname, "w");
+    if (tim_fh == NULL) {
+        perr("Can't open timing report %s: %s\n", fname, strerror(errno));
+        exit(1);
+    }
+    tim_json = len > 5 && !strcmp(fname + len - 5, ".json");
+    if (tim_json)
+        fputs("[\n", tim_fh);
+    else
+        fputs("user,host,port,ret,spawn,first,exit,drain\n", tim_fh);
+    tim_start = mono_now();
+}
+
+static void
+timing_add(int phase, double v, struct procslot *pslot)
+{
+    struct tim_phase *tp = &tim_phase[phase];
+    size_t len;
+
+    if (tp->n == tp->cap) {
+        tp->cap = tp->cap ? tp->cap * 2 : 1024;
+        tp->v = realloc(tp->v, tp->cap * sizeof(float));
+        if (tp->v == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+    }
+    if (tp->n == 0 || v > tp->v[0]) {
+        /* keep the max in front, it is sorted later anyway */
+        if (tp->n)
+            tp->v[tp->n] = tp->v[0];
+        tp->v[0] = v;
+        free(tp->slowest);
+        len = strlen(pslot->hst->user) + strlen(pslot->hst->host) + 2;
+        tp->slowest = malloc(len);
+        if (tp->slowest)
+            snprintf(tp->slowest, len, "%s@%s",
+                pslot->hst->user, pslot->hst->host);
+    } else {
+        tp->v[tp->n] = v;
+    }
+    tp->n++;
+}
+
+/* json strings, the names can only have a few odd chars */
+static void
+timing_str(const char *s)
+{
+    fputc('"', tim_fh);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', tim_fh);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, tim_fh);
+    }
+    fputc('"', tim_fh);
+}
+
+/*
+ * record the timing of a finished host, called by the reaper
+ * once its output is drained
+ */
+void
+timing_host(struct procslot *pslot)
+{
+    double  drain = mono_now();
+    double  spawn = pslot->t_spawn;
+    struct  host *hst = pslot->hst;
+
+    if (pslot->t_first)
+        timing_add(TIM_FIRST, pslot->t_first - spawn, pslot);
+    timing_add(TIM_EXIT, pslot->t_exit - spawn, pslot);
+    timing_add(TIM_DRAIN, drain - pslot->t_exit, pslot);
+    timing_add(TIM_TOTAL, drain - spawn, pslot);
+
+    if (tim_json) {
+        fputs(tim_nrec ? ",\n  {\"user\":" : "  {\"user\":", tim_fh);
+        timing_str(hst->user);
+        fputs(",\"host\":", tim_fh);
+        timing_str(hst->host);
+        fprintf(tim_fh, ",\"port\":%d,\"ret\":%d,\"spawn\":%.6f,\"first\":",
+            hst->port, pslot->ret, spawn - tim_start);
+        if (pslot->t_first)
+            fprintf(tim_fh, "%.6f", pslot->t_first - spawn);
+        else
+            fputs("null", tim_fh);
+        fprintf(tim_fh, ",\"exit\":%.6f,\"drain\":%.6f}",
+            pslot->t_exit - spawn, drain - spawn);
+    } else {
+        fprintf(tim_fh, "%s,%s,%d,%d,%.6f,", hst->user, hst->host,
+            hst->port, pslot->ret, spawn - tim_start);
+        if (pslot->t_first)
+            fprintf(tim_fh, "%.6f", pslot->t_first - spawn);
+        fprintf(tim_fh, ",%.6f,%.6f\n", pslot->t_exit - spawn, drain - spawn);
+    }
+    tim_nrec++;
+}
+
+static int
+timing_cmp(const void *a, const void *b)
+{
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+
+    return((x > y) - (x < y));
+}
+
+static double
+timing_pct(struct tim_phase *tp, double pct)
+{
+    size_t i = (size_t)(pct * tp->n + 0.999999);
+
+    return(tp->v[i ? i - 1 : 0]);
+}
+
+/*
+ * close the report and print the percentiles of every phase
+ */
+void
+timing_close(void)
+{
+    struct tim_phase *tp;
+    int               i;
+
+    if (tim_json)
+        fputs(tim_nrec ? "\n]\n" : "]\n", tim_fh);
+    if (fclose(tim_fh))
+        perr("Can't write timing report: %s\n", strerror(errno));
+    tim_fh = NULL;
+
+    fprintf(stderr, "\n  %-10s %8s %9s %9s %9s %9s  %s\n", "time (ms)",
+        "hosts", "p50", "p90", "p99", "max", "slowest");
+    for (i = 0; i < TIM_PHASES; i++) {
+        tp = &tim_phase[i];
+        if (tp->n == 0)
+            continue;
+        qsort(tp->v, tp->n, sizeof(float), timing_cmp);
+        fprintf(stderr, "  %-10s %8zu %9.1f %9.1f %9.1f %9.1f  %s\n",
+            tim_name[i], tp->n, timing_pct(tp, 0.50) * 1000,
+            timing_pct(tp, 0.90) * 1000, timing_pct(tp, 0.99) * 1000,
+            tp->v[tp->n - 1] * 1000, tp->slowest ? tp->slowest : "");
+        free(tp->v);
+        free(tp->slowest);
+    }
+}
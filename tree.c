@@ -0,0 +1,417 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "mpssh.h"
+#include "host.h"
+#include "group.h"
+#include "timer.h"
+#include "pslot.h"
+#include "metrics.h"
+#include "out.h"
+#include "tree.h"
+
+struct host *host_next(void);
+void   host_put(struct host *);
+void   fanout_init(int);
+void   outbuf_line(struct outbuf *, const char *, size_t, const char *, size_t);
+
+static struct subtree *tr_list = NULL;
+static int             tr_count = 0;
+static int             tr_next = 0;
+
+/*
+ * split the selected hosts in ntree subtrees of about the same
+ * size and write their host lists, one after the other, to
+ * the input memfd. returns the number of subtrees.
+ */
+int
+tree_init(int ntree)
+{
+    struct host **hosts = NULL;
+    struct host  *hst;
+    FILE         *fh;
+    char         *np;
+    size_t        nlen;
+    int           cap = 0;
+    int           n = 0;
+    int           per;
+    int           fd;
+    int           i, j;
+
+    while ((hst = host_next()) != NULL) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            hosts = realloc(hosts, cap * sizeof(struct host *));
+            if (hosts == NULL) {
+                perr("Can't alloc mem in %s\n", __func__);
+                exit(1);
+            }
+        }
+        hosts[n++] = hst;
+    }
+    if (n == 0)
+        return(0);
+
+    if (ntree > n)
+        ntree = n;
+    per = (n + ntree - 1) / ntree;
+    tr_count = (n + per - 1) / per;
+    tr_list = calloc(tr_count, sizeof(struct subtree));
+    if (tr_list == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+
+    fd = memfd_create("mpssh-tree", MFD_CLOEXEC);
+    if (fd < 0 || (fh = fdopen(dup(fd), "w")) == NULL) {
+        perr("unable to create memfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (i = 0; i < tr_count; i++) {
+        tr_list[i].relay = hosts[i * per];
+        tr_list[i].off = ftell(fh);
+        nlen = 0;
+        for (j = i * per; j < n && j < (i + 1) * per; j++)
+            nlen += strlen(hosts[j]->user) + strlen(hosts[j]->host) + 2;
+        if ((np = tr_list[i].names = malloc(nlen)) == NULL) {
+            perr("Can't alloc mem in %s\n", __func__);
+            exit(1);
+        }
+        for (j = i * per; j < n && j < (i + 1) * per; j++) {
+            hst = hosts[j];
+            np = stpcpy(np, hst->user) + 1;
+            np = stpcpy(np, hst->host) + 1;
+            if (hst->port != NON_DEFINED_PORT)
+                fprintf(fh, "%s@%s:%d\n", hst->user, hst->host, hst->port);
+            else
+                fprintf(fh, "%s@%s\n", hst->user, hst->host);
+            /* the relays run their own subtree too */
+            if (j != i * per)
+                host_put(hst);
+            tr_list[i].nhosts++;
+        }
+        tr_list[i].end = ftell(fh);
+    }
+    if (fclose(fh)) {
+        perr("unable to write the subtrees: %s\n", strerror(errno));
+        exit(1);
+    }
+    free(hosts);
+
+    /* the subtrees are sent from the start of the file */
+    lseek(fd, 0, SEEK_SET);
+    fanout_init(fd);
+    return(tr_count);
+}
+
+/*
+ * the next relay to spawn, or NULL
+ */
+struct host *
+tree_next(void)
+{
+    if (tr_next == tr_count)
+        return(NULL);
+    return(tr_list[tr_next++].relay);
+}
+
+static unsigned int
+tree_hash(const char *user, size_t ulen, const char *host, size_t hlen)
+{
+    unsigned int h = 2166136261U;
+    size_t       i;
+
+    for (i = 0; i < ulen; i++)
+        h = (h ^ (unsigned char)user[i]) * 16777619U;
+    h = (h ^ '@') * 16777619U;
+    for (i = 0; i < hlen; i++)
+        h = (h ^ (unsigned char)host[i]) * 16777619U;
+    return(h);
+}
+
+/*
+ * the slot of the relay handed out last is set up, give it
+ * its subtree's hosts as input
+ */
+void
+tree_start(struct procslot *p)
+{
+    struct subtree *t = &tr_list[tr_next - 1];
+    struct relay   *r;
+    struct rhost   *rh;
+    const char     *np;
+    unsigned int    hsize;
+    unsigned int    h;
+    int             i;
+
+    for (hsize = 1; hsize < (unsigned int)t->nhosts * 2; hsize <<= 1)
+        ;
+    r = calloc(1, sizeof(struct relay) +
+        t->nhosts * sizeof(struct rhost) + hsize * sizeof(int));
+    if (r == NULL) {
+        perr("Can't alloc mem in %s\n", __func__);
+        exit(1);
+    }
+    r->hosts = (struct rhost *)(r + 1);
+    r->hhead = (int *)(r->hosts + t->nhosts);
+    r->hmask = hsize - 1;
+    memset(r->hhead, 0xff, hsize * sizeof(int));
+
+    np = t->names;
+    for (i = 0; i < t->nhosts; i++) {
+        rh = &r->hosts[i];
+        rh->user = np;
+        np += strlen(np) + 1;
+        rh->host = np;
+        np += strlen(np) + 1;
+        h = tree_hash(rh->user, strlen(rh->user),
+            rh->host, strlen(rh->host)) & r->hmask;
+        rh->hnext = r->hhead[h];
+        r->hhead[h] = i;
+    }
+    r->nhosts = t->nhosts;
+    p->relay = r;
+    p->in_off = t->off;
+    p->in_end = t->end;
+}
+
+/*
+ * mark the host of the last frame as reported. returns 0
+ * if it is not in the subtree or was reported already.
+ */
+static int
+tree_report(struct relay *r)
+{
+    struct rhost *rh;
+    int           i;
+
+    i = r->hhead[tree_hash(r->user, strlen(r->user),
+        r->host, strlen(r->host)) & r->hmask];
+    for (; i >= 0; i = rh->hnext) {
+        rh = &r->hosts[i];
+        if (!rh->done && !strcmp(rh->user, r->user) &&
+            !strcmp(rh->host, r->host)) {
+            rh->done = 1;
+            r->ndone++;
+            return(1);
+        }
+    }
+    return(0);
+}
+
+/*
+ * a decimal number ending at a tab, or at the end for the
+ * last field. returns a pointer past it, or NULL.
+ */
+static const char *
+tree_num(const char *p, const char *end, int last, uint64_t *v)
+{
+    const char *s = p;
+
+    *v = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - s < 19)
+        *v = *v * 10 + (*p++ - '0');
+    if (p == s)
+        return(NULL);
+    if (last)
+        return(p == end ? p : NULL);
+    if (p == end || *p != '\t')
+        return(NULL);
+    return(p + 1);
+}
+
+/*
+ * print the relayed line of a host with its own prefix
+ */
+static void
+tree_print(struct relay *r, const char *line, size_t len)
+{
+    struct outbuf *ob;
+    char           pfx[MAXNAME * 3];
+    char          *mark;
+    int            n;
+
+    if (r->stream == 'E') {
+        if (no_err)
+            return;
+        ob = thr_err;
+        mark = pfx_err[err_tty + 1];
+    } else {
+        if (no_out)
+            return;
+        ob = &ob_out;
+        mark = pfx_out[out_tty + 1];
+    }
+    if (blind)
+        return;
+    if (verbose)
+        n = snprintf(pfx, sizeof(pfx), "%*s@%*s %s ",
+            user_len_max, r->user, host_len_max, r->host, mark);
+    else
+        n = snprintf(pfx, sizeof(pfx), "%*s %s ",
+            host_len_max, r->host, mark);
+    if (n >= (int)sizeof(pfx))
+        n = sizeof(pfx) - 1;
+    outbuf_line(ob, pfx, n, line, len);
+}
+
+/*
+ * a relayed host is done, count it and print its status
+ * the way pslot_printbuf() does for the local sessions.
+ * relay is the exit code of a relay that lost the host.
+ */
+static void
+tree_exit(struct relay *r, int ret, int relay)
+{
+    char   line[MAXNAME * 3];
+    char   pfx[MAXNAME * 2 + 2];
+    int    n;
+
+    done++;
+    if (r->stream == 'T')
+        metrics.timeouts++;
+    else if (ret == 0)
+        metrics.ok++;
+    else if (ret == 255)
+        metrics.sshfail++;
+    else
+        metrics.errors++;
+
+    if (verbose)
+        snprintf(pfx, sizeof(pfx), "%*s@%*s",
+            user_len_max, r->user, host_len_max, r->host);
+    else
+        snprintf(pfx, sizeof(pfx), "%*s", host_len_max, r->host);
+
+    if (relay >= 0) {
+        n = snprintf(line, sizeof(line), "%s %s relay failure (exit %d)",
+            pfx, pfx_crt[out_tty], relay);
+    } else if (r->stream == 'T') {
+        n = snprintf(line, sizeof(line), "%s %s timeout",
+            pfx, pfx_crt[out_tty]);
+    } else if (ret == 255) {
+        n = snprintf(line, sizeof(line), "%s %s ssh failure",
+            pfx, pfx_crt[out_tty]);
+    } else if (print_exit) {
+        n = snprintf(line, sizeof(line), "%s %s %d", pfx,
+            pfx_ret[out_tty ? (ret ? 2 : 1) : 0], ret);
+    } else {
+        return;
+    }
+    if (n >= (int)sizeof(line))
+        n = sizeof(line) - 1;
+    outbuf_line(&ob_out, line, n, "", 0);
+}
+
+/*
+ * one line of a relay's stdout, a frame or the rest of one
+ * that was split by our --max-line. anything else is the
+ * relay's own output.
+ */
+void
+tree_line(struct procslot *p, const char *line, size_t len)
+{
+    struct relay *r = p->relay;
+    const char   *end = line + len;
+    const char   *u;
+    const char   *h;
+    const char   *t;
+    const char   *d;
+    size_t        ulen;
+    size_t        hlen;
+    uint64_t      v;
+
+    if (r->left) {
+        if (len > r->left)
+            len = r->left;
+        r->left -= len;
+        tree_print(r, line, len);
+        return;
+    }
+
+    if (len > 2 && line[0] && line[1] == '\t' && strchr("OEXT", line[0]) &&
+        (h = memchr(line + 2, '\t', len - 2)) != NULL &&
+        (t = memchr(h + 1, '\t', end - h - 1)) != NULL &&
+        (d = tree_num(t + 1, end, line[0] == 'X' || line[0] == 'T',
+        &v)) != NULL && (d == end || (uint64_t)(end - d) <= v)) {
+        u = line + 2;
+        ulen = h - u;
+        h++;
+        hlen = t - h;
+        if (ulen > MAXNAME)
+            ulen = MAXNAME;
+        if (hlen > MAXNAME)
+            hlen = MAXNAME;
+        r->stream = line[0];
+        memcpy(r->user, u, ulen);
+        r->user[ulen] = '\0';
+        memcpy(r->host, h, hlen);
+        r->host[hlen] = '\0';
+        if (r->stream == 'X' || r->stream == 'T') {
+            /* a host is reported once, and only one of ours */
+            if (tree_report(r))
+                tree_exit(r, (int)v, -1);
+            return;
+        }
+        r->left = v - (end - d);
+        tree_print(r, d, end - d);
+        return;
+    }
+    if (!no_out && !blind)
+        outbuf_line(&ob_out, p->pfx[OUT], p->pfxlen[OUT], line, len);
+}
+
+/*
+ * the relay is gone, the hosts that it did not report are
+ * counted as ssh failures, each with its own status line
+ */
+void
+tree_done(struct procslot *p)
+{
+    struct relay *r = p->relay;
+    int           i;
+
+    for (i = 0; i < r->nhosts && r->ndone < r->nhosts; i++) {
+        if (r->hosts[i].done)
+            continue;
+        r->hosts[i].done = 1;
+        r->ndone++;
+        snprintf(r->user, sizeof(r->user), "%s", r->hosts[i].user);
+        snprintf(r->host, sizeof(r->host), "%s", r->hosts[i].host);
+        r->stream = 'X';
+        tree_exit(r, 255, p->ret);
+    }
+}
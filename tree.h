@@ -0,0 +1,84 @@
+/*-
+ * Copyright (c) 2005-2015 Nikolay Denev <ndenev@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ * derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tree mode. the selected hosts are split in subtrees, the
+ * first host of each is a relay: mpssh sshes to it and runs
+ * another mpssh there in relay mode, with the subtree's hosts
+ * on its stdin. the relay prints one frame per line:
+ *
+ *  O \t user \t host \t len \t line    stdout line of a host
+ *  E \t user \t host \t len \t line    stderr line of a host
+ *  X \t user \t host \t code           a host is done
+ *  T \t user \t host \t code           a host timed out
+ *
+ * and the frames are turned back into the usual output. len
+ * is the length of the line, so when we split a long frame
+ * the pieces after the first are known to be its rest, even
+ * if they look like a frame.
+ */
+#define RELAYCMD    "mpssh"         /* default relay command */
+
+/*
+ * a subtree, its relay and its hosts in the input memfd.
+ * names has the user and host of each, NUL terminated, to
+ * tell which ones the relay reported.
+ */
+struct
+subtree {
+    struct host *relay;
+    uint64_t     off;
+    uint64_t     end;
+    int          nhosts;
+    char        *names;
+};
+
+/* a host of a relay's subtree */
+struct
+rhost {
+    const char  *user;
+    const char  *host;
+    int          done;
+    int          hnext;             /* hash chain, -1 at the end */
+};
+
+/*
+ * per relay session state, allocated in one piece with the
+ * hosts of its subtree and their hash table
+ */
+struct
+relay {
+    int          nhosts;
+    int          ndone;             /* X and T frames seen */
+    char         stream;            /* of the last frame */
+    uint64_t     left;              /* bytes of a split frame to come */
+    char         user[MAXNAME + 1];
+    char         host[MAXNAME + 1];
+    struct rhost *hosts;
+    int         *hhead;
+    unsigned int hmask;
+};